@@ -0,0 +1,331 @@
+#define _POSIX_C_SOURCE 200112L
+#define _GNU_SOURCE  // CMSG_SPACE, CMSG_LEN and struct ucred (linux)
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <unistd.h>
+#include <errno.h>
+#include <time.h>
+#include <limits.h>   // PATH_MAX
+#include <poll.h>
+#include <signal.h>
+#include <sys/stat.h>
+#include <sys/wait.h>
+#include <sys/socket.h>
+#include <sys/un.h>
+#include "util.h"
+#include "daemon.h"
+
+#define ADDRESS_TTL 60  // seconds that a resolved address is reused
+#define NAMESIZE 320     // host name (at most 253) and port
+#define DECLINED 255     // reply when the client should run the request
+
+// the environment of a request: the daemon declines requests that differ in
+// the variables that it read when it started, and sets the others for them
+static const char* STARTUP[] = {"HGET_ARGS", "XDG_CONFIG_HOME", "HOME"};
+static const char* RUNTIME[] = {"HTTPS_PROXY", "https_proxy", "HTTP_PROXY",
+    "http_proxy", "PROGRESS", "PATH", "XDG_CACHE_HOME"};
+#define NSTARTUP (int)(sizeof(STARTUP) / sizeof(STARTUP[0]))
+#define NRUNTIME (int)(sizeof(RUNTIME) / sizeof(RUNTIME[0]))
+
+typedef struct {
+    char name[NAMESIZE];
+    int family;
+    socklen_t len;
+    struct sockaddr_storage addr;
+    time_t expires;
+} Address;
+
+// ISO C99 6.7.8/10 static objects are initialized to 0
+static Address addresses[256];
+static int naddresses, cachefd = -1;  // workers send new addresses to cachefd
+static char sessions[PATH_MAX];       // directory of tls session files
+
+static int set_name(char* name, char* host, char* port) {
+    return snprintf(name, NAMESIZE, "%s:%s", host, port) < NAMESIZE;
+}
+
+socklen_t find_address(char* host, char* port, int family,
+        struct sockaddr_storage* addr) {
+    char name[NAMESIZE];
+    time_t now = time(NULL);
+    if (naddresses == 0 || !set_name(name, host, port))
+        return 0;
+    for (int i = 0; i < naddresses; i++) {
+        Address* a = &addresses[i];
+        if (a->family == family && a->expires > now &&
+                strcmp(a->name, name) == 0) {
+            memcpy(addr, &a->addr, sizeof(*addr));
+            return a->len;
+        }
+    }
+    return 0;
+}
+
+static void add_address(Address* address) {
+    int i = 0, oldest = 0, N = sizeof(addresses) / sizeof(Address);
+    for (; i < naddresses; i++) {
+        if (addresses[i].family == address->family &&
+                strcmp(addresses[i].name, address->name) == 0)
+            break;
+        if (addresses[i].expires < addresses[oldest].expires)
+            oldest = i;
+    }
+    if (i == naddresses && naddresses < N)
+        naddresses++;
+    addresses[i < N ? i : oldest] = *address;
+}
+
+void keep_address(char* host, char* port, int family,
+        struct sockaddr_storage* addr, socklen_t len) {
+    Address address = {.family = family, .len = len,
+                       .expires = time(NULL) + ADDRESS_TTL};
+    if (cachefd < 0 || !set_name(address.name, host, port))
+        return;
+    memcpy(&address.addr, addr, sizeof(address.addr));
+    // writes of at most PIPE_BUF bytes to a pipe are atomic
+    if (write(cachefd, &address, sizeof(address)) != sizeof(address))
+        cachefd = -1;
+}
+
+char* get_session(char* host, char* port) {
+    static char path[PATH_MAX];
+    if (sessions[0] == 0 || snprintf(path, sizeof(path), "%s/%s:%s",
+            sessions, host, port[0] ? port : "443") >= (int)sizeof(path))
+        return NULL;
+    return path;
+}
+
+static int connect_unix(char* path) {
+    struct sockaddr_un addr = {.sun_family = AF_UNIX};
+    if (strlen(path) >= sizeof(addr.sun_path))
+        fail("error: daemon socket path too long", EUSAGE);
+    strcpy(addr.sun_path, path);
+    int sock = socket(AF_UNIX, SOCK_STREAM, 0);
+    if (sock == -1)
+        sfail("socket create failed");
+    if (connect(sock, (struct sockaddr*)&addr, sizeof(addr)) != 0) {
+        close(sock);
+        return -1;
+    }
+    return sock;
+}
+
+static void send_all(int sock, const char* buf, size_t len) {
+    for (ssize_t n = 0; len > 0; buf += n, len -= n)
+        if ((n = write(sock, buf, len)) <= 0)
+            sfail("send failed");
+}
+
+static const char* get_name(int i) {
+    return i < NSTARTUP ? STARTUP[i] : RUNTIME[i - NSTARTUP];
+}
+
+static void send_environment(int sock) {
+    // "<name>=<value>" for each variable that is set, or "<name>" otherwise
+    for (int i = 0; i < NSTARTUP + NRUNTIME; i++) {
+        const char* value = getenv(get_name(i));
+        send_all(sock, get_name(i), strlen(get_name(i)));
+        if (value) {
+            send_all(sock, "=", 1);
+            send_all(sock, value, strlen(value));
+        }
+        send_all(sock, "", 1);
+    }
+}
+
+// the request is "<cwd>\0<environment>\0...<argv[0]>\0<argv[1]>\0..." with
+// stdout and stderr passed as SCM_RIGHTS; the reply is a single byte with the
+// exit status, or DECLINED
+int call_daemon(char* path, int argc, char* argv[]) {
+    char cwd[PATH_MAX];
+    int sock = connect_unix(path);
+    if (sock == -1)
+        return -1;  // no daemon, so run in this process
+    if (getcwd(cwd, sizeof(cwd)) == NULL)
+        sfail("getcwd failed");
+
+    int fds[2] = {STDOUT_FILENO, STDERR_FILENO};
+    char control[CMSG_SPACE(sizeof(fds))];
+    memset(control, 0, sizeof(control));
+    struct iovec iov = {cwd, strlen(cwd) + 1};
+    struct msghdr msg = {.msg_iov = &iov, .msg_iovlen = 1,
+        .msg_control = control, .msg_controllen = sizeof(control)};
+    struct cmsghdr* cmsg = CMSG_FIRSTHDR(&msg);
+    cmsg->cmsg_level = SOL_SOCKET;
+    cmsg->cmsg_type = SCM_RIGHTS;
+    cmsg->cmsg_len = CMSG_LEN(sizeof(fds));
+    memcpy(CMSG_DATA(cmsg), fds, sizeof(fds));
+    if (sendmsg(sock, &msg, 0) != (ssize_t)iov.iov_len)
+        sfail("send failed");
+    send_environment(sock);
+    for (int i = 0; i < argc; i++)
+        send_all(sock, argv[i], strlen(argv[i]) + 1);
+    shutdown(sock, SHUT_WR);
+
+    unsigned char status = ESYSTEM;
+    if (read(sock, &status, 1) != 1)
+        fail("error: daemon failed", ESYSTEM);
+    close(sock);
+    return status == DECLINED ? -1 : status;
+}
+
+static char* receive(int conn, int* fds, size_t* size) {
+    size_t len = 0, capacity = BUFSIZE;
+    char* buf = malloc(capacity);
+    char control[CMSG_SPACE(2 * sizeof(int))];
+    struct iovec iov = {buf, capacity};
+    struct msghdr msg = {.msg_iov = &iov, .msg_iovlen = 1,
+        .msg_control = control, .msg_controllen = sizeof(control)};
+    ssize_t n = buf ? recvmsg(conn, &msg, 0) : -1;
+    struct cmsghdr* cmsg = n > 0 ? CMSG_FIRSTHDR(&msg) : NULL;
+    if (cmsg == NULL || cmsg->cmsg_type != SCM_RIGHTS ||
+            cmsg->cmsg_len != CMSG_LEN(2 * sizeof(int)))
+        exit(EUSAGE);
+    memcpy(fds, CMSG_DATA(cmsg), 2 * sizeof(int));
+    for (len = n; n > 0; len += n) {
+        if (len == capacity && (buf = realloc(buf, capacity *= 2)) == NULL)
+            sfail("alloc failed");
+        n = read(conn, buf + len, capacity - len);
+    }
+    if (n < 0 || len == 0 || buf[len - 1] != 0)
+        exit(EUSAGE);
+    *size = len;
+    return buf;
+}
+
+static int set_environment(char** env) {
+    // returns 0 if a variable that was read at startup differs
+    for (int i = 0; i < NSTARTUP + NRUNTIME; i++) {
+        size_t n = strlen(get_name(i));
+        char* value = env[i][n] == '=' ? env[i] + n + 1 : NULL;
+        char* current = getenv(get_name(i));
+        if (strncmp(env[i], get_name(i), n) != 0 || (env[i][n] && !value))
+            exit(EUSAGE);
+        if (i < NSTARTUP && (value ? !current || strcmp(value, current) :
+                current != NULL))
+            return 0;
+        if (i >= NSTARTUP && (value ? setenv(get_name(i), value, 1) :
+                unsetenv(get_name(i))) != 0)
+            sfail("setenv failed");
+    }
+    return 1;
+}
+
+static void handle_client(int conn, int (*run)(int, char**)) {
+    int fds[2], status = ESYSTEM, N = NSTARTUP + NRUNTIME;
+    size_t size = 0;
+    char* buf = receive(conn, fds, &size);
+    int argc = -1 - N;
+    for (size_t i = 0; i < size; i += strlen(buf + i) + 1)
+        argc++;
+    if (argc < 0)
+        exit(EUSAGE);
+    char* argv[argc + N + 1];
+    argv[argc + N] = NULL;
+    // buf starts with the working directory, the environment and then the
+    // arguments
+    for (size_t i = strlen(buf) + 1, j = 0; i < size; i += strlen(buf+i) + 1)
+        argv[j++] = buf + i;
+
+    // run in a child so the exit status can be sent even when it fails
+    pid_t pid = argc > 0 ? fork() : -1;
+    if (pid == 0) {
+        close(conn);
+        if (!set_environment(argv))
+            exit(DECLINED);
+        if (chdir(buf) != 0 || dup2(fds[0], STDOUT_FILENO) == -1 ||
+                dup2(fds[1], STDERR_FILENO) == -1)
+            exit(EUSAGE);
+        close(fds[0]);
+        close(fds[1]);
+        exit(run(argc, argv + N));
+    }
+    if (pid > 0 && waitpid(pid, &status, 0) == pid)
+        status = WIFEXITED(status) ? WEXITSTATUS(status) : ESYSTEM;
+    unsigned char byte = (unsigned char)status;
+    send_all(conn, (char*)&byte, 1);
+    exit(OK);
+}
+
+static int is_owner(int conn) {
+    // only the user that runs the daemon may use it, since requests run
+    // commands (PROGRESS) and write files as that user
+#ifdef SO_PEERCRED
+    struct ucred cred;
+    socklen_t len = sizeof(cred);
+    return getsockopt(conn, SOL_SOCKET, SO_PEERCRED, &cred, &len) == 0 &&
+           cred.uid == getuid();
+#else
+    uid_t uid;
+    gid_t gid;
+    return getpeereid(conn, &uid, &gid) == 0 && uid == getuid();
+#endif
+}
+
+static void read_addresses(int fd) {
+    Address address;
+    if (read(fd, &address, sizeof(address)) == sizeof(address))
+        add_address(&address);
+}
+
+int serve(char* path, int (*run)(int, char**)) {
+    struct sockaddr_un addr = {.sun_family = AF_UNIX};
+    int cache[2] = {0, 0};  // cache[0] is read end, cache[1] is write end
+    if (strlen(path) >= sizeof(addr.sun_path) ||
+            snprintf(sessions, sizeof(sessions), "%s.tls", path) >=
+            (int)sizeof(sessions))
+        fail("error: daemon socket path too long", EUSAGE);
+    strcpy(addr.sun_path, path);
+    if (mkdir(sessions, 0700) != 0 && errno != EEXIST)
+        sfail("failed to create tls session directory");
+
+    int sock = socket(AF_UNIX, SOCK_STREAM, 0);
+    if (sock == -1)
+        sfail("socket create failed");
+    unlink(path);  // remove the socket of a previous daemon
+    mode_t mask = umask(077);  // the socket is created with mode 0600
+    if (bind(sock, (struct sockaddr*)&addr, sizeof(addr)) != 0 ||
+            chmod(path, 0600) != 0 || listen(sock, 64) != 0)
+        sfail("failed to listen on daemon socket");
+    umask(mask);
+    if (pipe(cache) != 0)
+        sfail("pipe failed");
+    cachefd = cache[1];
+    if (signal(SIGCHLD, SIG_IGN) == SIG_ERR)  // reap clients automatically
+        sfail("signal failed");
+
+    struct pollfd fds[2] = {{sock, POLLIN, 0}, {cache[0], POLLIN, 0}};
+    while (1) {
+        if (poll(fds, 2, -1) < 0) {
+            if (errno == EINTR)
+                continue;
+            sfail("poll failed");
+        }
+        if (fds[1].revents & POLLIN)
+            read_addresses(cache[0]);
+        if (!(fds[0].revents & POLLIN))
+            continue;
+        int conn = accept(sock, NULL, NULL);
+        if (conn == -1)
+            continue;
+        if (!is_owner(conn)) {
+            close(conn);
+            continue;
+        }
+        switch (fork()) {
+            case -1:
+                close(conn);
+                break;
+            case 0:  // child
+                signal(SIGCHLD, SIG_DFL);  // so that waitpid works
+                close(sock);
+                close(cache[0]);
+                handle_client(conn, run);
+                break;
+            default:
+                close(conn);
+        }
+    }
+    return OK;
+}
@@ -0,0 +1,7 @@
+int call_daemon(char* path, int argc, char* argv[]);
+int serve(char* path, int (*run)(int, char**));
+socklen_t find_address(char* host, char* port, int family,
+        struct sockaddr_storage* addr);
+void keep_address(char* host, char* port, int family,
+        struct sockaddr_storage* addr, socklen_t len);
+char* get_session(char* host, char* port);
@@ -0,0 +1,110 @@
+#define _POSIX_C_SOURCE 200112L
+#include <stdint.h>
+#include <string.h>
+#include "digest.h"
+
+static uint32_t rotl(uint32_t x, int s) {
+    return x << s | x >> (32 - s);
+}
+
+// md4 (RFC 1320), which zsync uses as the strong checksum of each block
+static void md4_block(uint32_t* h, const unsigned char* p) {
+    static const int order[3][16] = {
+        {0, 1, 2, 3, 4, 5, 6, 7, 8, 9, 10, 11, 12, 13, 14, 15},
+        {0, 4, 8, 12, 1, 5, 9, 13, 2, 6, 10, 14, 3, 7, 11, 15},
+        {0, 8, 4, 12, 2, 10, 6, 14, 1, 9, 5, 13, 3, 11, 7, 15}};
+    static const int shift[3][4] = {{3, 7, 11, 19}, {3, 5, 9, 13},
+                                    {3, 9, 11, 15}};
+    static const uint32_t add[3] = {0, 0x5a827999, 0x6ed9eba1};
+    uint32_t x[16], r[4] = {h[0], h[1], h[2], h[3]};
+    for (int i = 0; i < 16; i++)
+        x[i] = p[4*i] | p[4*i+1] << 8 | p[4*i+2] << 16 |
+               (uint32_t)p[4*i+3] << 24;
+    for (int round = 0; round < 3; round++) {
+        for (int i = 0; i < 16; i++) {
+            uint32_t b = r[1], c = r[2], d = r[3];
+            uint32_t f = round == 0 ? (b & c) | (~b & d) :
+                         round == 1 ? (b & c) | (b & d) | (c & d) : b ^ c ^ d;
+            uint32_t t = rotl(r[0] + f + x[order[round][i]] + add[round],
+                              shift[round][i % 4]);
+            // the registers rotate so that r[0] is always the one updated
+            r[0] = d, r[3] = c, r[2] = b, r[1] = t;
+        }
+    }
+    for (int i = 0; i < 4; i++)
+        h[i] += r[i];
+}
+
+void md4(const unsigned char* data, size_t len, unsigned char* out) {
+    uint32_t h[4] = {0x67452301, 0xefcdab89, 0x98badcfe, 0x10325476};
+    unsigned char tail[128] = {0};
+    size_t i = 0;
+    for (; i + 64 <= len; i += 64)
+        md4_block(h, data + i);
+    size_t n = len - i, padded = n < 56 ? 64 : 128;
+    memcpy(tail, data + i, n);
+    tail[n] = 0x80;
+    for (int j = 0; j < 8; j++)  // little endian length in bits
+        tail[padded - 8 + j] = (unsigned char)((uint64_t)len * 8 >> 8 * j);
+    for (size_t j = 0; j < padded; j += 64)
+        md4_block(h, tail + j);
+    for (int j = 0; j < 16; j++)
+        out[j] = (unsigned char)(h[j / 4] >> 8 * (j % 4));
+}
+
+// sha-1 (FIPS 180-4), which zsync uses for the whole file
+static void sha1_block(uint32_t* h, const unsigned char* p) {
+    uint32_t w[80], r[5] = {h[0], h[1], h[2], h[3], h[4]};
+    for (int i = 0; i < 16; i++)
+        w[i] = (uint32_t)p[4*i] << 24 | p[4*i+1] << 16 | p[4*i+2] << 8 |
+               p[4*i+3];
+    for (int i = 16; i < 80; i++)
+        w[i] = rotl(w[i-3] ^ w[i-8] ^ w[i-14] ^ w[i-16], 1);
+    for (int i = 0; i < 80; i++) {
+        uint32_t b = r[1], c = r[2], d = r[3];
+        uint32_t f = i < 20 ? ((b & c) | (~b & d)) + 0x5a827999 :
+                     i < 40 ? (b ^ c ^ d) + 0x6ed9eba1 :
+                     i < 60 ? ((b & c) | (b & d) | (c & d)) + 0x8f1bbcdc :
+                     (b ^ c ^ d) + 0xca62c1d6;
+        uint32_t t = rotl(r[0], 5) + f + r[4] + w[i];
+        r[4] = d, r[3] = c, r[2] = rotl(b, 30), r[1] = r[0], r[0] = t;
+    }
+    for (int i = 0; i < 5; i++)
+        h[i] += r[i];
+}
+
+void sha1_init(Sha1* sha) {
+    static const uint32_t h[5] = {0x67452301, 0xefcdab89, 0x98badcfe,
+                                  0x10325476, 0xc3d2e1f0};
+    memcpy(sha->h, h, sizeof(h));
+    sha->len = 0;
+}
+
+void sha1_update(Sha1* sha, const unsigned char* data, size_t len) {
+    size_t used = sha->len % 64;
+    sha->len += len;
+    if (used && used + len < 64) {
+        memcpy(sha->buf + used, data, len);
+        return;
+    }
+    if (used) {
+        memcpy(sha->buf + used, data, 64 - used);
+        sha1_block(sha->h, sha->buf);
+        data += 64 - used;
+        len -= 64 - used;
+    }
+    for (; len >= 64; data += 64, len -= 64)
+        sha1_block(sha->h, data);
+    memcpy(sha->buf, data, len);
+}
+
+void sha1_final(Sha1* sha, unsigned char* out) {
+    unsigned char pad[72] = {0x80};
+    uint64_t bits = sha->len * 8;
+    size_t n = 64 - (sha->len + 8) % 64;  // 1 to 64 bytes of padding
+    for (int i = 0; i < 8; i++)  // big endian length in bits
+        pad[n + i] = (unsigned char)(bits >> 8 * (7 - i));
+    sha1_update(sha, pad, n + 8);
+    for (int i = 0; i < 20; i++)
+        out[i] = (unsigned char)(sha->h[i / 4] >> 8 * (3 - i % 4));
+}
@@ -0,0 +1,13 @@
+#include <stddef.h>  // size_t
+#include <stdint.h>
+
+typedef struct {
+    uint32_t h[5];
+    uint64_t len;
+    unsigned char buf[64];
+} Sha1;
+
+void md4(const unsigned char* data, size_t len, unsigned char* out);
+void sha1_init(Sha1* sha);
+void sha1_update(Sha1* sha, const unsigned char* data, size_t len);
+void sha1_final(Sha1* sha, unsigned char* out);
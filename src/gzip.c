@@ -0,0 +1,166 @@
+#define _POSIX_C_SOURCE 200112L
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <pthread.h>
+#include <zlib.h>
+#include "util.h"
+#include "gzip.h"
+
+#define BLOCK 131072   // input bytes compressed by each thread at a time
+#define WINDOW 32768   // deflate window, primed from the previous block
+
+enum {EMPTY, READY, BUSY, DONE};
+
+typedef struct {
+    int state, last;
+    unsigned char *in, *out;  // in is the window followed by the block
+    size_t window, len, outlen;
+    unsigned long crc;
+} Slot;
+
+// one mutex guards the slot states, the workers wait on ready and the
+// sender waits on done
+static pthread_mutex_t lock = PTHREAD_MUTEX_INITIALIZER;
+static pthread_cond_t ready = PTHREAD_COND_INITIALIZER;
+static pthread_cond_t done = PTHREAD_COND_INITIALIZER;
+static Slot* slots;
+static int nslots, finished;
+
+// blocks are raw deflate streams ending on a byte boundary (like pigz), so
+// that their concatenation is a single deflate stream
+static void compress_block(Slot* slot) {
+    z_stream z = {0};
+    if (deflateInit2(&z, Z_DEFAULT_COMPRESSION, Z_DEFLATED, -15, 8,
+            Z_DEFAULT_STRATEGY) != Z_OK)
+        fail("error: deflate failed", ESYSTEM);
+    if (slot->window)
+        deflateSetDictionary(&z, slot->in, slot->window);
+    size_t N = compressBound(BLOCK) + 64;
+    z.next_in = slot->in + slot->window;
+    z.avail_in = slot->len;
+    z.next_out = slot->out;
+    z.avail_out = N;
+    int result = deflate(&z, slot->last ? Z_FINISH : Z_SYNC_FLUSH);
+    if (result != (slot->last ? Z_STREAM_END : Z_OK) || z.avail_in != 0)
+        fail("error: deflate failed", ESYSTEM);
+    slot->outlen = N - z.avail_out;
+    deflateEnd(&z);
+    slot->crc = crc32(0, slot->in + slot->window, slot->len);
+}
+
+static void* work(void* arg) {
+    (void)arg;
+    pthread_mutex_lock(&lock);
+    while (!finished) {
+        Slot* slot = NULL;
+        for (int i = 0; i < nslots && slot == NULL; i++)
+            if (slots[i].state == READY)
+                slot = &slots[i];
+        if (slot == NULL) {
+            pthread_cond_wait(&ready, &lock);
+            continue;
+        }
+        slot->state = BUSY;
+        pthread_mutex_unlock(&lock);
+        compress_block(slot);
+        pthread_mutex_lock(&lock);
+        slot->state = DONE;
+        pthread_cond_broadcast(&done);
+    }
+    pthread_mutex_unlock(&lock);
+    return NULL;
+}
+
+static void send_chunk(FILE* sock, const void* data, size_t len) {
+    if (fprintf(sock, "%zx\r\n", len) < 0 ||
+            fwrite(data, 1, len, sock) != len || fputs("\r\n", sock) == EOF)
+        sfail("send failed");
+}
+
+// reads the next block, with the end of the previous block as its window
+static void fill(Slot* slot, FILE* file, unsigned char* window,
+        size_t* windowlen) {
+    slot->window = *windowlen;
+    memcpy(slot->in, window, *windowlen);
+    slot->len = fread(slot->in + slot->window, 1, BLOCK, file);
+    if (ferror(file))
+        sfail("failed to read upload file");
+    int c = slot->len == BLOCK ? getc(file) : EOF;
+    slot->last = c == EOF || ungetc(c, file) == EOF;
+    size_t end = slot->window + slot->len;
+    *windowlen = end < WINDOW ? end : WINDOW;
+    memcpy(window, slot->in + end - *windowlen, *windowlen);
+}
+
+void send_gzip(FILE* sock, const char* path, int threads) {
+    static const unsigned char header[10] = {0x1f, 0x8b, 8, 0, 0, 0, 0, 0, 0,
+                                             3};
+    unsigned char window[WINDOW], trailer[8];
+    size_t windowlen = 0, total = 0;
+    unsigned long crc = crc32(0, NULL, 0);
+    FILE* file = fopen(path, "r");
+    if (!file)
+        sfail("failed to open upload file");
+
+    nslots = 2 * threads;
+    finished = 0;
+    pthread_t* workers = calloc(threads, sizeof(pthread_t));
+    slots = calloc(nslots, sizeof(Slot));
+    for (int i = 0; slots && i < nslots; i++) {
+        slots[i].in = malloc(WINDOW + BLOCK);
+        slots[i].out = malloc(compressBound(BLOCK) + 64);
+        if (!slots[i].in || !slots[i].out)
+            sfail("alloc failed");
+    }
+    if (slots == NULL || workers == NULL)
+        sfail("alloc failed");
+    for (int i = 0; i < threads; i++)
+        if (pthread_create(&workers[i], NULL, work, NULL) != 0)
+            sfail("pthread_create failed");
+
+    send_chunk(sock, header, sizeof(header));
+    int eof = 0;
+    for (size_t next = 0, sent = 0; !eof || sent < next; sent++) {
+        // keep every slot busy while sending the blocks in order
+        for (; !eof && next - sent < (size_t)nslots; next++) {
+            Slot* slot = &slots[next % nslots];
+            fill(slot, file, window, &windowlen);
+            eof = slot->last;
+            pthread_mutex_lock(&lock);
+            slot->state = READY;
+            pthread_cond_signal(&ready);
+            pthread_mutex_unlock(&lock);
+        }
+        Slot* slot = &slots[sent % nslots];
+        pthread_mutex_lock(&lock);
+        while (slot->state != DONE)
+            pthread_cond_wait(&done, &lock);
+        slot->state = EMPTY;  // not refilled until after it has been sent
+        pthread_mutex_unlock(&lock);
+        send_chunk(sock, slot->out, slot->outlen);
+        crc = crc32_combine(crc, slot->crc, slot->len);
+        total += slot->len;
+    }
+
+    pthread_mutex_lock(&lock);
+    finished = 1;
+    pthread_cond_broadcast(&ready);
+    pthread_mutex_unlock(&lock);
+    for (int i = 0; i < threads; i++)
+        pthread_join(workers[i], NULL);
+    free(workers);
+    fclose(file);
+    for (int i = 0; i < nslots; i++) {
+        free(slots[i].in);
+        free(slots[i].out);
+    }
+    free(slots);
+
+    for (int i = 0; i < 4; i++) {  // little endian crc and size mod 2^32
+        trailer[i] = (crc >> 8 * i) & 0xff;
+        trailer[4 + i] = (total >> 8 * i) & 0xff;
+    }
+    send_chunk(sock, trailer, sizeof(trailer));
+    swrite(sock, "0\r\n\r\n");
+}
@@ -0,0 +1,7 @@
+#define MAXTHREADS 64  // each thread has two 288 KiB slots
+
+#ifdef ZLIB
+void send_gzip(FILE* sock, const char* path, int threads);
+#else
+#define send_gzip(...) fail("error: compressed uploads not supported", EUSAGE)
+#endif
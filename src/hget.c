@@ -5,9 +5,19 @@
 #include <unistd.h>
 #include <limits.h>   // PATH_MAX
 #include <signal.h>
+#include <time.h>
+#include <errno.h>
 #include <sys/wait.h>
+#include <sys/socket.h>
 #include "util.h"
 #include "interact.h"
+#include "mirror.h"
+#include "zsync.h"
+#include "upload.h"
+#include "gzip.h"
+#include "swarm.h"
+#include "trace.h"
+#include "daemon.h"
 
 // "There are three common forms of intermediary: proxy, gateway, and tunnel.
 // A proxy is a forwarding agent, receiving requests for a URI in its absolute
@@ -16,7 +26,7 @@
 // "...the method name CONNECT for use with a proxy that can dynamically switch
 // to being a tunnel"
 // https://datatracker.ietf.org/doc/html/rfc2616 (1999)
-const char* USAGE = "Usage: hget [options] <url>\n"
+const char* USAGE = "Usage: hget [options] <url> [<mirror url>...]\n"
 "Options:\n"
 "  -o <path>       write output to the specified file or directory\n"
 "  -n <path>       only download if server file is newer than local file\n"
@@ -26,6 +36,16 @@ const char* USAGE = "Usage: hget [options] <url>\n"
 "  -t <url>        use HTTP/HTTPS tunnel\n"
 "  -p <url>        use HTTP/HTTPS proxy (insecure for https)\n"
 "  -w <seconds>    wait time for connection timeout\n"
+"  -y <count>      retry transient failures up to count times\n"
+"  -g <jobs>       mirror files linked under url using concurrent jobs\n"
+"  -S <dir>        keep downloads in a store and link them to the output\n"
+"  -T <path>       trace phase latencies to a histogram or .json trace file\n"
+"  -F              flush output after each chunk (for interactive streams)\n"
+"  -D <path>       serve requests as a daemon on the unix socket path\n"
+"  -K              move http:// bodies within the kernel (linux splice)\n"
+"  -R <ranges>     only download the byte ranges (e.g. 0-99,-512)\n"
+"  -U              update the output file using the block map at <url>.zsync\n"
+"  -3              use http/3 (quic) for https urls\n"
 "  -e              output entire response (include response header)\n"
 "  -d              output direct response (disable redirects)\n"
 "  -l              lax mode (output response regardless of response status)\n"
@@ -37,6 +57,9 @@ const char* USAGE = "Usage: hget [options] <url>\n"
 "  -b <body>       set the body of the request\n"
 "  -u <path>       upload file as request body\n"
 "  -z              request a gzip compressed response and output gzip file\n"
+"  -Z <threads>    upload the file gzip compressed using threads\n"
+"  -P <jobs>       upload the file in parts with concurrent ranged PUTs\n"
+"  -E <ms>         wait up to ms for 100 Continue before sending the body\n"
 "  -f              force https connection even if it is insecure\n"
 "  -c <path>       use the specified CA cert file or directory\n"
 "  -i <path>       set the client identity certificate\n"
@@ -45,9 +68,12 @@ const char* USAGE = "Usage: hget [options] <url>\n"
 
 // ISO C99 6.7.8/10 static objects are initialized to 0
 static int quiet, entire, direct, lax, insecure, timeout, tunnel;
-static int suppress, resume, verbose, zip, nheaders, wget;
+static int suppress, resume, verbose, zip, nheaders, wget, retries, jobs;
+static int compress, flush, zerocopy, update, quic, parts, expect, worker;
 static char *dest, *upload, *proxyurl, *auth, *cacerts, *cert, *key, *method;
-static char *body, *newer, *headers[32];
+static char *body, *newer, *store, *trace, *daemonpath, *range, *part;
+static char* headers[32];
+static URL proxy;
 
 static void timeout_fail(int signal) {
     (void)signal;
@@ -90,10 +116,13 @@ static void usage(int status, int full) {
     exit(status);
 }
 
+static const char* OPTIONS =
+    "o:u:t:p:w:y:g:S:T:D:a:c:m:h:b:i:k:n:fqsredlxvjzFKU3Z:R:P:E:";
+
 static void parse_args(int argc, char* argv[]) {
     // glibc bug: https://sourceware.org/bugzilla/show_bug.cgi?id=25658
     optind = 1;  // https://stackoverflow.com/a/60484617/2647751
-    const char* opts = wget ? "O:q" : "o:u:t:p:w:a:c:m:h:b:i:k:n:fqsredlxvjz";
+    const char* opts = wget ? "O:q" : OPTIONS;
     for (int opt; (opt = getopt(argc, argv, opts)) != -1;) {
         switch (opt) {
             case 'O':
@@ -103,6 +132,11 @@ static void parse_args(int argc, char* argv[]) {
             case 'p': proxyurl = optarg; tunnel = 0; break;
             case 'f': insecure = 1; break;
             case 'w': timeout = atoi(optarg); break;
+            case 'y': retries = atoi(optarg); break;
+            case 'g': jobs = atoi(optarg); break;
+            case 'S': store = optarg; break;
+            case 'T': trace = optarg; break;
+            case 'D': daemonpath = optarg; break;
             case 'a': auth = optarg; break;
             case 'c': cacerts = optarg; break;
             case 'n': newer = optarg; break;
@@ -119,6 +153,14 @@ static void parse_args(int argc, char* argv[]) {
             case 'k': key = optarg; break;
             case 'v': verbose = 1; break;
             case 'z': zip = 1; break;
+            case 'Z': compress = atoi(optarg); break;
+            case 'P': parts = atoi(optarg); break;
+            case 'E': expect = atoi(optarg); break;
+            case 'F': flush = 1; break;
+            case 'K': zerocopy = 1; break;
+            case 'U': update = 1; break;
+            case 'R': range = optarg; break;
+            case '3': quic = 1; break;
             case 'j':
                 if (nheaders >= (int)(sizeof(headers)/sizeof(char*) - 2))
                     fail("Too many header arguments", EUSAGE);
@@ -176,29 +218,164 @@ static char* get_config_path(char* buffer, char* relpath) {
     return NULL;
 }
 
-int main(int argc, char *argv[]) {
-    wget = strcmp(get_filename(argv[0]), "wget") == 0;
-    dest = wget ? "." : NULL;
+static int get_status(int status_code) {
+    if (lax || status_code/100 == 2 || status_code/100 == 3)
+        return OK;
+    if (status_code == 404 || status_code == 410)
+        return ENOTFOUND;
+    if (status_code/100 == 4)
+        return EREQUEST;
+    return ESERVER;  // 5xx, 1xx, and invalid status codes
+}
 
-    char argfile_path[PATH_MAX];
-    get_config_path(argfile_path, "args");
-    size_t argfile_size = wget ? 0 : get_file_size(argfile_path);
-    char buffer[argfile_size + 1];  // must be in main scope to keep optargs
-    if (argfile_size)
-        parse_argfile(argv[0], argfile_path, buffer, argfile_size);
+static int fetch(URL url, FILE* bar, FILE* report, int partial,
+        char* etag) {
+    return get_status(interact(url, proxy, tunnel, quic, auth, method, headers,
+                          body, upload, part, dest, entire, direct, lax, newer,
+                          partial, etag, range, cacerts, cert, key, insecure,
+                          timeout, verbose, zip, compress, expect, flush,
+                          zerocopy, store, bar, report, 0));
+}
 
-    char* envargs = wget ? NULL : getenv("HGET_ARGS");
-    // ISO C99 7.20.4.5: The getenv function
-    // "The string pointed to shall not be modified by the program"
-    char envbuf[(envargs ? strlen(envargs) : 0) + 1];
-    parse_argstring(argv[0], strcpy(envbuf, envargs ? envargs : ""));
+static int is_transient(int status, int status_code) {
+    // protocol errors are only reported once the body has started, where
+    // they mean that the connection was cut off
+    if (status == ESYSTEM || status == ETIMEOUT ||
+            (status == EPROTOCOL && status_code/100 == 2))
+        return 1;
+    return !lax && (status_code == 408 || status_code == 429 ||
+        status_code == 500 || status_code == 502 || status_code == 503 ||
+        status_code == 504);
+}
+
+#define MAXBACKOFF (1000L << 6)  // milliseconds
+
+static void backoff(int attempt, long after) {
+    // "full jitter": sleep a random time up to the exponential backoff
+    // https://aws.amazon.com/blogs/architecture/exponential-backoff-and-jitter/
+    // and never longer than the ceiling, whatever Retry-After asks for
+    long ms = after >= 0 ? (after < MAXBACKOFF / 1000 ? after * 1000 :
+        MAXBACKOFF) : rand() % ((1000L << (attempt < 6 ? attempt : 6)) + 1);
+    struct timespec delay = {ms / 1000, (ms % 1000) * 1000000};
+    while (nanosleep(&delay, &delay) != 0);
+}
+
+static int retry(URL url, FILE* bar, char* ifrange) {
+    // each attempt runs in a child process because errors exit the process;
+    // the child reports each response status line back through a pipe (and
+    // ifrange is the entity tag that the ranges of each attempt must match)
+    char line[BUFSIZE], etag[BUFSIZE] = "";
+    int partial = resume;
+    srand((unsigned)time(NULL) ^ (unsigned)getpid());
+    for (int attempt = 0;; attempt++) {
+        int fd[2] = {0, 0};  // fd[0] is read end, fd[1] is write end
+        if (pipe(fd) != 0)
+            sfail("pipe failed");
+        pid_t pid = fork();
+        if (pid == -1)
+            sfail("fork failed");
+        if (pid == 0) {  // child
+            close(fd[0]);
+            FILE* report = fdopen(fd[1], "w");
+            if (report == NULL)
+                sfail("fdopen failed");
+            exit(fetch(url, bar, report, partial,
+                       partial && etag[0] ? etag : ifrange));
+        }
+        close(fd[1]);
+        FILE* report = fdopen(fd[0], "r");
+        if (report == NULL)
+            sfail("fdopen failed");
+        int status_code = 0, status = 0;
+        long after = -1;
+        char* tag = "";
+        while (fgets(line, sizeof(line), report)) {
+            status_code = (int)strtol(line, &tag, 10);
+            after = strtol(tag, &tag, 10);
+            tag += strspn(tag, " ");
+            tag[strcspn(tag, "\n")] = 0;
+            if (status_code/100 == 2 && tag[0] && strncmp(tag, "W/", 2) != 0)
+                strcpy(etag, tag);  // weak tags cannot be used with If-Range
+        }
+        fclose(report);
+        if (waitpid(pid, &status, 0) == -1)
+            sfail("waitpid failed");
+        status = WIFEXITED(status) ? WEXITSTATUS(status) : ESYSTEM;
+
+        if (status == OK || attempt >= retries ||
+                !is_transient(status, status_code))
+            return status;
+        if (status_code/100 == 2) {  // body was interrupted
+            if (is_stdout(dest) || isdir(dest))
+                return status;
+            // a body for the store went to a temporary file that is gone
+            if (range)
+                ;  // the ranges are written again in place
+            else if (etag[0] && strcmp(method, "GET") == 0 && !store)
+                partial = 1;
+            else if (!resume && unlink(dest) != 0 && errno != ENOENT)
+                return status;  // restart from scratch without an etag
+        }
+        fprintf(stderr, "retrying (%d/%d)\n", attempt + 1, retries);
+        backoff(attempt, status_code == 429 || status_code == 503 ? after : -1);
+    }
+}
+
+static int download(char* link, char* path, char* since) {
+    // called in a child process for each file that is mirrored
+    dest = path;
+    newer = since;
+    return retries ? retry(parse_url(link), NULL, NULL) :
+                     fetch(parse_url(link), NULL, NULL, resume, NULL);
+}
+
+static int download_range(char* link, char* path, char* bytes,
+        char* etag) {
+    // called in a child process for the block map and each set of ranges,
+    // which must come from the version of the file that etag names (if any)
+    dest = path;
+    range = bytes;
+    return retries ? retry(parse_url(link), NULL, etag) :
+                     fetch(parse_url(link), NULL, NULL, 0, etag);
+}
+
+static int probe_range(char* link, char* path, char* bytes) {
+    // called in a child process for the response header of each mirror
+    entire = 1;
+    return download_range(link, path, bytes, NULL);
+}
+
+static int upload_part(char* link, char* bytes) {
+    // called in a child process for each part of a parallel upload
+    part = bytes;
+    dest = NULL;
+    return retries ? retry(parse_url(link), NULL, NULL) :
+                     fetch(parse_url(link), NULL, NULL, 0, NULL);
+}
 
+static int handle(int argc, char* argv[]);
+
+static int run(int argc, char* argv[]) {
     parse_args(argc, argv);
 
-    if (optind != argc - 1)
+    if (daemonpath && worker)
+        fail("error: -D cannot be sent to a daemon", EUSAGE);
+
+    if (daemonpath && optind == argc)
+        return serve(daemonpath, handle);
+
+    if (optind == argc)
         usage(argc == 1 ? 0 : EUSAGE, argc == 1);
 
+    // any further urls are mirrors of the same file
+    int nurls = argc - optind;
     char* arg = argv[optind++];
+    char seed[strlen(arg) + 1];  // parse_url modifies the string
+    strcpy(seed, arg);
+    char* urls[nurls];
+    urls[0] = seed;
+    for (int i = 1; i < nurls; i++)
+        urls[i] = argv[optind++];
     URL url = parse_url(arg);
 
     if (!proxyurl) {
@@ -216,17 +393,27 @@ int main(int argc, char *argv[]) {
     // modifying getenv strings is undefined behavior (ISO C99 7.20.4.5)
     char proxybuf[proxyurl ? strlen(proxyurl) + 1 : 1];
     strcpy(proxybuf, proxyurl ? proxyurl : "");
-    URL proxy = proxyurl ? parse_url(proxybuf) : (URL){0};
+    proxy = proxyurl ? parse_url(proxybuf) : (URL){0};
 
     if (!auth && url.userinfo[0])
         auth = url.userinfo;  // so auth will apply to redirects
 
-    if (!resume && !is_stdout(dest) && !isdir(dest) && access(dest, F_OK) == 0)
+    if (!resume && !update && !is_stdout(dest) && !isdir(dest) &&
+            access(dest, F_OK) == 0)
         fail("error: output file already exists", EUSAGE);
 
     if (resume && (is_stdout(dest) || isdir(dest) || access(dest, W_OK) != 0))
         fail("error: partial download file is invalid or inaccessible", EUSAGE);
 
+    if (jobs < 0)
+        fail("error: -g requires a positive job count", EUSAGE);
+
+    if (jobs && !isdir(dest))
+        fail("error: mirror requires an output directory", EUSAGE);
+
+    if (update && (is_stdout(dest) || isdir(dest) || resume || jobs))
+        fail("error: -U requires an output file and no -r or -g", EUSAGE);
+
     if (!is_stdout(dest) && isdir(dest) && chdir(dest) != 0)
         fail("error: output directory is not accessible", EUSAGE);
 
@@ -236,33 +423,100 @@ int main(int argc, char *argv[]) {
     if (upload && isdir(upload))
         fail("error: upload cannot be a directory", EUSAGE);
 
+    if (nurls > 1 && (is_stdout(dest) || isdir(dest) || resume || update ||
+            jobs || range || parts || upload || body))
+        fail("error: mirror urls require an output file and a download",
+             EUSAGE);
+
+    if (range && (resume || update || jobs || !range[0] ||
+            range[strspn(range, "0123456789-,")] != 0))
+        fail("error: -R requires byte ranges and no -r, -U or -g", EUSAGE);
+
+    if (compress < 0 || compress > MAXTHREADS || (compress && !upload))
+        fail("error: -Z requires -u and 1 to 64 threads", EUSAGE);
+
+    if (parts < 0 || (parts && (!upload || compress || resume || update ||
+            jobs || range)))
+        fail("error: -P requires -u and a positive job count", EUSAGE);
+
+    if (expect < 0)
+        fail("error: -E requires a positive wait time", EUSAGE);
+
     if (timeout)
         signal(SIGALRM, timeout_fail);
 
+    if (trace)
+        start_tracing(trace);
+
     if (is_stdout(dest) && isatty(1))
         quiet = 1;   // prevent mixing progress bar with output on stdout
 
     if (!method)
-        method = (body || upload) ? "POST" : "GET";
+        method = parts ? "PUT" : (body || upload) ? "POST" : "GET";
 
-    FILE* bar = quiet ? NULL : open_pipe(getenv("PROGRESS"), arg);
+    FILE* bar = quiet || jobs || parts || nurls > 1 ? NULL :
+                open_pipe(getenv("PROGRESS"), arg);
     if (suppress)  // do this here so that usage errors still print to stderr
         freopen("/dev/null", "w", stderr);
-    int status_code = interact(url, proxy, tunnel, auth, method, headers, body,
-                          upload, dest, entire, direct, lax, newer, resume,
-                          cacerts, cert, key, insecure, timeout, verbose, zip,
-                          bar, 0);
+    int status = jobs ? mirror(seed, jobs, download) :
+                 update ? zsync(seed, dest, download_range) :
+                 parts ? upload_parts(seed, upload, parts, upload_part) :
+                 nurls > 1 ? swarm(urls, nurls, dest, probe_range,
+                                   download_range) :
+                 retries ? retry(url, bar, NULL) :
+                 fetch(url, bar, NULL, resume, NULL);
 
     if (bar) {
         fclose(bar); // this will cause bar to get EOF and exit soon
         wait(NULL);  // wait for bar to finish drawing
     }
+    return status;
+}
 
-    if (lax || status_code/100 == 2 || status_code/100 == 3)
-        return OK;
-    if (status_code == 404 || status_code == 410)
-        return ENOTFOUND;
-    if (status_code/100 == 4)
-        return EREQUEST;
-    return ESERVER;  // 5xx, 1xx, and invalid status codes
+static int handle(int argc, char* argv[]) {
+    // called in a child of the daemon with the arguments of a client
+    daemonpath = NULL;
+    worker = 1;
+    wget = strcmp(get_filename(argv[0]), "wget") == 0;
+    dest = wget && !dest ? "." : dest;
+    return run(argc, argv);
+}
+
+static int has_daemon_option(int argc, char* argv[]) {
+    // parsed like parse_args so that grouped options like -qD are found
+    int found = 0;
+    optind = 1;
+    opterr = 0;  // parse_args reports the errors
+    for (int opt; (opt = getopt(argc, argv, OPTIONS)) != -1;)
+        found |= opt == 'D';
+    opterr = 1;
+    return found;
+}
+
+int main(int argc, char *argv[]) {
+    wget = strcmp(get_filename(argv[0]), "wget") == 0;
+    dest = wget ? "." : NULL;
+
+    // HGET_DAEMON is ignored when starting a daemon
+    char* path = getenv("HGET_DAEMON");
+    if (path && !wget && has_daemon_option(argc, argv))
+        path = NULL;
+    int status = path ? call_daemon(path, argc, argv) : -1;
+    if (status >= 0)
+        return status;
+
+    char argfile_path[PATH_MAX];
+    get_config_path(argfile_path, "args");
+    size_t argfile_size = wget ? 0 : get_file_size(argfile_path);
+    char buffer[argfile_size + 1];  // must be in main scope to keep optargs
+    if (argfile_size)
+        parse_argfile(argv[0], argfile_path, buffer, argfile_size);
+
+    char* envargs = wget ? NULL : getenv("HGET_ARGS");
+    // ISO C99 7.20.4.5: The getenv function
+    // "The string pointed to shall not be modified by the program"
+    char envbuf[(envargs ? strlen(envargs) : 0) + 1];
+    parse_argstring(argv[0], strcpy(envbuf, envargs ? envargs : ""));
+
+    return run(argc, argv);
 }
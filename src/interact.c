@@ -3,6 +3,7 @@
 #include <stdlib.h>
 #include <string.h>
 #include <unistd.h>
+#include <poll.h>
 #include <netdb.h>
 #include <sys/socket.h>
 #include "util.h"
@@ -10,24 +11,46 @@
 #include "request.h"
 #include "response.h"
 #include "interact.h"
+#include "trace.h"
+#include "daemon.h"
+#include "quic.h"
 
-static int try_conn(char* host, char* port, sa_family_t family) {
+static socklen_t resolve(char* host, char* port, sa_family_t family,
+        struct sockaddr_storage* addr) {
     struct addrinfo *server;
     struct addrinfo hints = {.ai_family = family, .ai_socktype = SOCK_STREAM};
 
+    trace_begin("dns");
     if (getaddrinfo(host, port, &hints, &server) != 0)
         sfail("getaddrinfo failed");
+    trace_end("dns");
+
+    socklen_t len = server->ai_addrlen;
+    memcpy(addr, server->ai_addr, len);
+    freeaddrinfo(server);
+    return len;
+}
 
-    int sockfd = socket(server->ai_family, server->ai_socktype,
-        server->ai_protocol);
+static int try_conn(char* host, char* port, sa_family_t family) {
+    // a daemon keeps addresses that were resolved by previous requests
+    struct sockaddr_storage addr;
+    socklen_t len = find_address(host, port, family, &addr);
+    int cached = len > 0;
+    if (!cached)
+        len = resolve(host, port, family, &addr);
+
+    int sockfd = socket(addr.ss_family, SOCK_STREAM, 0);
     if (sockfd == -1)
         sfail("socket create failed");
 
-    int result = connect(sockfd, server->ai_addr, server->ai_addrlen);
+    trace_begin("connect");
+    int result = connect(sockfd, (struct sockaddr*)&addr, len);
+    trace_end("connect");
 
-    freeaddrinfo(server);
     if (result != 0)
         close(sockfd);
+    else if (!cached)
+        keep_address(host, port, family, &addr, len);
     return result == 0 ? sockfd : -1;
 }
 
@@ -55,9 +78,13 @@ static FILE* opensock(URL server, char* cacerts, char* cert, char* key,
     (void)cacerts, (void)insecure, (void)cert, (void)key;
     int sockfd = conn(server.scheme, server.host, server.port, timeout);
     int https = strcmp(server.scheme, "https") == 0;
-    FILE* sock = https ?
-        start_tls(sockfd, server.host, cacerts, cert, key, insecure) :
-        fdopen(sockfd, "r+");
+    FILE* sock = https ? start_tls(sockfd, server.host, cacerts, cert, key,
+                                   insecure, get_session(server.host,
+                                   server.port)) : fdopen(sockfd, "r+");
+    if (sock == NULL && https)  // verify with the whole CA bundle instead
+        sock = start_tls(conn(server.scheme, server.host, server.port,
+                         timeout), server.host, cacerts, cert, key, insecure,
+                         get_session(server.host, server.port));
     if (sock == NULL)
         sfail(https ? "error: start_tls failed" : "error: fdopen failed");
     return sock;
@@ -66,37 +93,103 @@ static FILE* opensock(URL server, char* cacerts, char* cert, char* key,
 static FILE* proxy_connect(char* buffer, FILE* proxysock, URL url, URL proxy,
         char* cacerts, char* cert, char* key, int insecure) {
     (void)cacerts, (void)insecure, (void)cert, (void)key;
+    trace_begin("proxy");
     send_proxy_connect(buffer, proxysock, url, proxy);
     check_proxy_connect(buffer, proxysock);
+    trace_end("proxy");
 
     if (strcmp(url.scheme, "https") != 0)
         return proxysock;
 
-    FILE* sock = wrap_tls(proxysock, url.host, cacerts, cert, key, insecure);
+    FILE* sock = wrap_tls(proxysock, url.host, cacerts, cert, key, insecure,
+                          get_session(url.host, url.port));
     if (sock == NULL)
         sfail("error: wrap_tls failed");
     return sock;
 }
 
-int interact(URL url, URL proxy, int tunnel, char* auth, char* method,
-        char** headers, char* body, char* upload, char* dest, int entire,
-        int direct, int lax, char* newer, int resume, char* cacerts, char* cert,
-        char* key, int insecure, int timeout, int verbose, int zip, FILE* bar,
-        int redirects) {
+static FILE* openquic(URL server, char* port, char* cacerts, int insecure,
+        int timeout, int early) {
+    // returns NULL if the quic handshake fails so that tcp is used instead
+    (void)cacerts, (void)insecure, (void)timeout, (void)early;
+    struct sockaddr_storage addr;
+    socklen_t len = find_address(server.host, port, AF_UNSPEC, &addr);
+    if (len == 0)
+        len = resolve(server.host, port, AF_UNSPEC, &addr);
+    return start_quic(&addr, len, server.host, port, cacerts, insecure,
+                      timeout, early);
+}
+
+static int is_readable(FILE* sock, int ms) {
+    // tls streams wait for decrypted data, and streams that are neither a
+    // socket nor tls are http/3
+    struct pollfd pfd = {fileno(sock), POLLIN, 0};
+    int ready = pfd.fd == -1 ? wait_tls(sock, ms) : poll(&pfd, 1, ms) > 0;
+    return ready == -1 ? wait_quic(sock, ms) : ready;
+}
+
+int interact(URL url, URL proxy, int tunnel, int quic, char* auth,
+        char* method, char** headers, char* body, char* upload, char* part,
+        char* dest, int entire, int direct, int lax, char* newer, int resume,
+        char* etag, char* range, char* cacerts, char* cert, char* key,
+        int insecure, int timeout, int verbose, int zip, int compress,
+        int expect, int flush, int zerocopy, char* store, FILE* bar,
+        FILE* report, int redirects) {
     char buffer[BUFSIZE];
+    trace_begin("hop");
     FILE* proxysock = proxy.host ?
         opensock(proxy, cacerts, cert, key, 0, timeout) : NULL;
-    FILE* sock = proxy.host ? (tunnel ? proxy_connect(buffer, proxysock, url,
-                 proxy, cacerts, cert, key, insecure) : proxysock) :
-                 opensock(url, cacerts, cert, key, insecure, timeout);
+    // http/3 is used when requested or advertised by Alt-Svc
+    char* h3port = proxy.host ? NULL : get_alt_svc(url, quic);
+    // only requests that are safe to replay are sent as 0-rtt early data
+    int early = !body && !upload && (strcmp(method, "GET") == 0 ||
+                                     strcmp(method, "HEAD") == 0);
+    FILE* sock = h3port ? openquic(url, h3port, cacerts, insecure, timeout,
+                                   early) : NULL;
+    if (sock == NULL && h3port && quic)
+        fail("error: http/3 connection failed", ESYSTEM);
+    if (sock == NULL && h3port)
+        break_alt_svc(url);  // before the tcp response advertises it again
+    if (sock == NULL)
+        sock = proxy.host ? (tunnel ? proxy_connect(buffer, proxysock, url,
+               proxy, cacerts, cert, key, insecure) : proxysock) :
+               opensock(url, cacerts, cert, key, insecure, timeout);
 
+    trace_begin("request");
     request(buffer, sock, url, tunnel ? (URL){0} : proxy, auth, method, headers,
-            body, upload, dest, newer, resume, verbose, zip);
-    int status_code = handle_response(buffer, sock, url, dest, resume, method,
-                                      entire, direct, lax, zip, bar);
+            body, upload, part, dest, newer, resume, etag, range, verbose, zip,
+            compress, expect);
+    // with Expect: 100-continue the body is sent after 100 Continue, or
+    // after the wait if the server does not answer at all
+    int waiting = expect && (body || upload);
+    if (waiting && !is_readable(sock, expect)) {
+        send_body(buffer, sock, body, upload, part, compress);
+        waiting = 0;
+    }
+    trace_end("request");
+    int status_code = handle_response(buffer, sock, url, dest, resume, etag,
+                                      range, method, expect, waiting, entire,
+                                      direct, lax, zip, flush, zerocopy, store,
+                                      bar, report);
+    if (status_code == 100) {
+        trace_begin("request");
+        send_body(buffer, sock, body, upload, part, compress);
+        trace_end("request");
+        status_code = handle_response(buffer, sock, url, dest, resume, etag,
+                                      range, method, expect, 0, entire, direct,
+                                      lax, zip, flush, zerocopy, store, bar,
+                                      report);
+    }
     fclose(sock);
     if (proxysock && proxysock != sock)
         fclose(proxysock);
+    trace_end("hop");
+
+    if (status_code == 417 && expect && !lax)  // retry without the expectation
+        return interact(url, proxy, tunnel, quic, auth, method, headers, body,
+            upload, part, dest, entire, direct, lax, newer, resume, etag,
+            range, cacerts, cert, key, insecure, timeout, verbose, zip,
+            compress, 0, flush, zerocopy, store, bar, report, redirects);
 
     if (!direct && status_code/100 == 3 && status_code != 304) {
         if (redirects >= 20)
@@ -104,10 +197,11 @@ int interact(URL url, URL proxy, int tunnel, char* auth, char* method,
         char* location = get_header(buffer, "Location:");
         if (location == NULL)
             fail("error: redirect missing location", EPROTOCOL);
-        return interact(parse_url(location), proxy, tunnel, auth,
-            status_code == 303 ? "GET" : method, headers, body, upload, dest,
-            entire, direct, lax, newer, resume, cacerts, cert, key, insecure,
-            timeout, verbose, zip, bar, redirects + 1);
+        return interact(parse_url(location), proxy, tunnel, quic, auth,
+            status_code == 303 ? "GET" : method, headers, body, upload, part,
+            dest, entire, direct, lax, newer, resume, etag, range, cacerts,
+            cert, key, insecure, timeout, verbose, zip, compress, expect,
+            flush, zerocopy, store, bar, report, redirects + 1);
     }
     return status_code;
 }
@@ -1,5 +1,7 @@
-int interact(URL url, URL proxy, int tunnel, char* auth, char* method,
-        char** headers, char* body, char* upload, char* dest, int entire,
-        int direct, int lax, char* newer, int resume, char* cacerts, char* cert,
-        char* key, int insecure, int timeout, int verbose, int zip, FILE* bar,
-        int redirects);
+int interact(URL url, URL proxy, int tunnel, int quic, char* auth,
+        char* method, char** headers, char* body, char* upload, char* part,
+        char* dest, int entire, int direct, int lax, char* newer, int resume,
+        char* etag, char* range, char* cacerts, char* cert, char* key,
+        int insecure, int timeout, int verbose, int zip, int compress,
+        int expect, int flush, int zerocopy, char* store, FILE* bar,
+        FILE* report, int redirects);
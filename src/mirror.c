@@ -0,0 +1,277 @@
+#define _POSIX_C_SOURCE 200112L
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <strings.h>  // strncasecmp
+#include <unistd.h>
+#include <errno.h>
+#include <limits.h>   // PATH_MAX
+#include <sys/stat.h>
+#include <sys/wait.h>
+#include "util.h"
+#include "mirror.h"
+
+typedef struct {
+    pid_t pid;
+    char* url;
+    FILE* page;  // receives an index page, or NULL for a file download
+    char path[PATH_MAX], part[PATH_MAX];
+} Job;
+
+// every link seen in the order it was found, indexed by a hash set
+static char **links, **table;
+static size_t nlinks, tablesize;
+
+static size_t hash(const char* s, size_t n) {
+    size_t h = 2166136261u;  // FNV-1a
+    for (size_t i = 0; i < n; i++)
+        h = (h ^ (unsigned char)s[i]) * 16777619u;
+    return h;
+}
+
+static char** lookup(char** set, size_t size, const char* s, size_t n) {
+    size_t i = hash(s, n) & (size - 1);
+    while (set[i] && (strncmp(set[i], s, n) != 0 || set[i][n] != 0))
+        i = (i + 1) & (size - 1);
+    return &set[i];
+}
+
+static void grow(void) {
+    size_t size = tablesize ? 2 * tablesize : 1024;
+    char** set = calloc(size, sizeof(char*));
+    links = realloc(links, size / 2 * sizeof(char*));
+    if (set == NULL || links == NULL)
+        sfail("alloc failed");
+    for (size_t i = 0; i < nlinks; i++)
+        *lookup(set, size, links[i], strlen(links[i])) = links[i];
+    free(table);
+    table = set;
+    tablesize = size;
+}
+
+static void add_link(const char* url, size_t n) {
+    if (nlinks >= tablesize / 2)  // keep load factor under 1/2
+        grow();
+    char** slot = lookup(table, tablesize, url, n);
+    if (*slot)
+        return;
+    char* copy = malloc(n + 1);
+    if (copy == NULL)
+        sfail("alloc failed");
+    memcpy(copy, url, n);
+    copy[n] = 0;
+    *slot = links[nlinks++] = copy;
+}
+
+static int is_dot_segment(const char* path) {
+    for (const char* p = path; p; p = strchr(p + 1, '/')) {
+        const char* s = p[0] == '/' ? p + 1 : p;
+        size_t n = strcspn(s, "/");
+        if ((n == 1 && s[0] == '.') || (n == 2 && strncmp(s, "..", 2) == 0))
+            return 1;
+    }
+    return 0;
+}
+
+// resolves link relative to page and returns the length of the result, or 0
+// if the result is not under base
+static size_t resolve(char* out, size_t N, char* page, char* link,
+        char* base) {
+    link[strcspn(link, "#")] = 0;
+    size_t n = 0, k = strcspn(link, ":/?");
+    if (link[0] == 0 || strchr(link, '?'))
+        return 0;  // skip sorting links in directory listings
+    if (link[k] == ':' && strncmp(link + k, "://", 3) != 0)
+        return 0;  // other schemes such as mailto:
+    char* host = strstr(page, "://") ? strstr(page, "://") + 3 : page;
+    char* path = host + strcspn(host, "/");
+    char* slash = strrchr(path, '/');
+    if (link[k] == ':')
+        n = snprintf(out, N, "%s", link);
+    else if (strncmp(link, "//", 2) == 0)
+        n = snprintf(out, N, "%.*s%s", (int)(host - page) - 2, page, link);
+    else if (link[0] == '/')
+        n = snprintf(out, N, "%.*s%s", (int)(path - page), page, link);
+    else if (slash)
+        n = snprintf(out, N, "%.*s%s", (int)(slash + 1 - page), page, link);
+    else
+        n = snprintf(out, N, "%s/%s", page, link);
+    if (n >= N || strncmp(out, base, strlen(base)) != 0 || n == strlen(base))
+        return 0;
+    return is_dot_segment(out + strlen(base)) ? 0 : n;
+}
+
+static size_t unescape(char* out, size_t N, const char* s, size_t n) {
+    size_t m = 0;
+    for (size_t i = 0; i < n && m < N - 1; i++, m++) {
+        if (strncmp(s + i, "&amp;", 5) == 0)
+            i += 4;  // html and xml
+        else if (strncmp(s + i, "\\/", 2) == 0)
+            i += 1;  // json
+        out[m] = s[i];
+    }
+    out[m] = 0;
+    return m < N - 1 ? m : 0;
+}
+
+// finds links in html href attributes, sitemap <loc> elements and absolute
+// urls in quoted strings (such as json manifests)
+static void scan(char* text, size_t len, char* page, char* base) {
+    char link[BUFSIZE], url[BUFSIZE];
+    for (char* p = text; p < text + len; p++) {
+        char* end = NULL;
+        int href = 0;
+        if (*p == '"' || *p == '\'') {
+            href = p - text >= 5 && strncasecmp(p - 5, "href=", 5) == 0;
+            end = memchr(p + 1, *p, text + len - (p + 1));
+        } else if (strncasecmp(p, "<loc>", 5) == 0) {
+            href = 1;
+            p += 4;
+            end = memchr(p + 1, '<', text + len - (p + 1));
+        }
+        if (end == NULL)
+            continue;
+        if (unescape(link, sizeof(link), p + 1, end - (p + 1)) &&
+                (href || strstr(link, "://"))) {
+            size_t n = resolve(url, sizeof(url), page, link, base);
+            if (n)
+                add_link(url, n);
+        }
+        p = end;
+    }
+}
+
+static void read_page(FILE* page, char* url, char* base) {
+    size_t len = 0, size = BUFSIZE;
+    char* text = malloc(size);
+    rewind(page);
+    for (size_t n = 1; text && n > 0; len += n) {
+        if (len + BUFSIZE + 1 > size)
+            text = realloc(text, size *= 2);
+        n = text ? fread(text + len, 1, BUFSIZE, page) : 0;
+    }
+    if (text == NULL || ferror(page))
+        sfail("read failed");
+    text[len] = 0;
+    scan(text, len, url, base);
+    free(text);
+}
+
+static int hexval(char c) {
+    return c >= '0' && c <= '9' ? c - '0' : c >= 'a' && c <= 'f' ? c - 'a' + 10
+        : c >= 'A' && c <= 'F' ? c - 'A' + 10 : -1;
+}
+
+// decodes the relative url into a local path and creates its directories
+static int get_local_path(char* path, char* rel) {
+    size_t n = 0;
+    for (; *rel && n < PATH_MAX - 6; n++, rel++) {
+        int hi = rel[0] == '%' ? hexval(rel[1]) : -1;
+        int lo = hi >= 0 ? hexval(rel[2]) : -1;
+        path[n] = lo >= 0 ? (char)(hi << 4 | lo) : rel[0];
+        if (lo >= 0)
+            rel += 2;
+        if (path[n] == 0)
+            return 0;
+    }
+    path[n] = 0;
+    if (*rel || path[0] == '/' || is_dot_segment(path))
+        return 0;
+    for (char* slash = strchr(path, '/'); slash; slash = strchr(slash+1, '/')) {
+        *slash = 0;
+        if (mkdir(path, 0777) != 0 && errno != EEXIST)
+            sfail("mkdir failed");
+        *slash = '/';
+    }
+    return 1;
+}
+
+static void start(Job* job, char* url, int index, char* base,
+        int (*download)(char*, char*, char*)) {
+    job->url = url;
+    job->page = NULL;
+    job->path[0] = job->part[0] = 0;
+    if (index || url[strlen(url) - 1] == '/') {
+        job->page = tmpfile();
+        if (job->page == NULL)
+            sfail("tmpfile failed");
+    } else if (get_local_path(job->path, url + strlen(base))) {
+        strcat(strcpy(job->part, job->path), ".part");
+        unlink(job->part);  // remove any stale partial download
+    } else {
+        job->pid = 0;
+        return;
+    }
+
+    fflush(stdout);
+    switch (job->pid = fork()) {
+        case -1:
+            sfail("fork failed");
+            return;
+        case 0:  // child
+            if (job->page) {
+                dup2(fileno(job->page), STDOUT_FILENO);
+                exit(download(url, "-", NULL));
+            }
+            // skip files that are unchanged using If-Modified-Since
+            exit(download(url, job->part,
+                    access(job->path, F_OK) == 0 ? job->path : NULL));
+    }
+}
+
+static int finish(Job* job, int status, char* base) {
+    if (job->page) {
+        if (status == OK)
+            read_page(job->page, job->url, base);
+        fclose(job->page);
+    } else if (status == OK && access(job->part, F_OK) == 0) {
+        if (rename(job->part, job->path) != 0)
+            sfail("rename failed");
+    } else
+        unlink(job->part);  // no partial file is left after 304 or failure
+    job->pid = 0;
+    return status;
+}
+
+int mirror(char* url, int jobs, int (*download)(char*, char*, char*)) {
+    // base is the directory of the url that all mirrored links must be under
+    char base[BUFSIZE];
+    char* host = strstr(url, "://") ? strstr(url, "://") + 3 : url;
+    size_t n = strcspn(url, "?#");
+    if (snprintf(base, sizeof(base), "%.*s%s", (int)n, url,
+            strcspn(host, "/?#") < n - (host - url) ? "" : "/") >=
+            (int)sizeof(base))
+        fail("error: url too long", EUSAGE);
+    strrchr(base, '/')[1] = 0;
+    add_link(url, strlen(url));
+
+    Job* job = calloc(jobs, sizeof(Job));  // too large for the stack
+    if (job == NULL)
+        sfail("alloc failed");
+    int status = OK, running = 0;
+    for (size_t next = 0; next < nlinks || running > 0;) {
+        for (int i = 0; i < jobs && next < nlinks; i++) {
+            if (job[i].pid == 0) {
+                start(&job[i], links[next], next == 0, base, download);
+                next++;
+                running += job[i].pid != 0;
+            }
+        }
+        if (running == 0)
+            continue;
+        int result = 0;
+        pid_t pid = wait(&result);
+        if (pid == -1)
+            sfail("wait failed");
+        result = WIFEXITED(result) ? WEXITSTATUS(result) : ESYSTEM;
+        for (int i = 0; i < jobs; i++) {
+            if (job[i].pid == pid) {
+                running--;
+                if (finish(&job[i], result, base) != OK && status == OK)
+                    status = result;
+            }
+        }
+    }
+    free(job);
+    return status;
+}
@@ -0,0 +1 @@
+int mirror(char* url, int jobs, int (*download)(char*, char*, char*));
@@ -0,0 +1,499 @@
+#define _POSIX_C_SOURCE 200112L
+#define _GNU_SOURCE   // sometimes needed for fopencookie (e.g. musl)
+#include <stdio.h>
+#include <stdlib.h>
+#include <stdint.h>
+#include <string.h>
+#include <strings.h>  // strncasecmp
+#include <ctype.h>    // tolower
+#include <time.h>
+#include <unistd.h>
+#include <fcntl.h>
+#include <limits.h>   // PATH_MAX
+#include <poll.h>
+#include <sys/socket.h>
+#include <quiche.h>
+#include "shim.h"
+#include "util.h"
+#include "response.h"
+#include "quic.h"
+#include "trace.h"
+
+#define DATAGRAM 1350       // udp payload that avoids fragmentation
+#define HANDSHAKE_MS 3000   // before falling back to tcp (without -w)
+#define BROKEN_S 3600       // seconds that tcp is used after a fallback
+
+// an http/3 request and response behind a stream that speaks http/1.1, so
+// that request() and handle_response() work unchanged
+typedef struct {
+    int fd;
+    quiche_config* config;
+    quiche_conn* conn;
+    quiche_h3_config* h3config;
+    quiche_h3_conn* h3;
+    struct sockaddr_storage local, peer;
+    socklen_t locallen, peerlen;
+    int64_t stream;       // -1 until the request header has been sent
+    int fin, data, finished;
+    int final, waiting;   // the body is held back while waiting is set
+    char head[BUFSIZE];   // request header, and then the response header
+    size_t headlen, headpos;
+    char session[PATH_MAX];
+    FILE* file;
+} Quic;
+
+static Quic* streams[4];  // for wait_quic, which only has the stream
+
+static long long now_ms(void) {
+    struct timespec ts;
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    return (long long)ts.tv_sec * 1000 + ts.tv_nsec / 1000000;
+}
+
+static void flush_egress(Quic* q) {
+    uint8_t out[DATAGRAM];
+    quiche_send_info info;
+    while (1) {
+        ssize_t n = quiche_conn_send(q->conn, out, sizeof(out), &info);
+        if (n == QUICHE_ERR_DONE)
+            return;
+        if (n < 0)
+            fail("error: quic send failed", EPROTOCOL);
+        if (send(q->fd, out, n, 0) != n)
+            sfail("send failed");
+    }
+}
+
+// waits for datagrams until the next quic timer, or at most ms
+static void wait_ingress(Quic* q, long long ms) {
+    static uint8_t buf[65535];
+    uint64_t timer = quiche_conn_timeout_as_millis(q->conn);
+    struct pollfd pfd = {q->fd, POLLIN, 0};
+    if (ms < 0 || (timer != UINT64_MAX && (long long)timer < ms))
+        ms = timer == UINT64_MAX ? -1 : (long long)timer;
+    int ready = poll(&pfd, 1, ms > INT_MAX ? INT_MAX : (int)ms);
+    if (ready < 0)
+        sfail("poll failed");
+    if (ready == 0 && timer != UINT64_MAX)
+        quiche_conn_on_timeout(q->conn);
+    for (ssize_t n = 0; ready > 0;) {
+        if ((n = recv(q->fd, buf, sizeof(buf), 0)) < 0)
+            break;  // EAGAIN (or an icmp error that the quic timer handles)
+        quiche_recv_info info = {(struct sockaddr*)&q->peer, q->peerlen,
+                                 (struct sockaddr*)&q->local, q->locallen};
+        quiche_conn_recv(q->conn, buf, n, &info);  // bad packets are dropped
+    }
+    flush_egress(q);
+}
+
+static void drive(Quic* q) {
+    flush_egress(q);
+    wait_ingress(q, -1);
+    if (quiche_conn_is_closed(q->conn))
+        fail("error: quic connection closed", EPROTOCOL);
+}
+
+static void send_body(Quic* q, const char* data, size_t len, int fin) {
+    if (len == 0 && !fin)
+        return;
+    while (1) {
+        ssize_t n = quiche_h3_send_body(q->h3, q->conn, q->stream,
+                                        (const uint8_t*)data, len, fin);
+        if (n == QUICHE_H3_ERR_DONE) {  // flow control
+            drive(q);
+            continue;
+        }
+        if (n < 0)
+            fail("error: http/3 send failed", EPROTOCOL);
+        data += n, len -= n;
+        if (len == 0)
+            break;
+    }
+    q->fin = fin;
+    flush_egress(q);
+}
+
+static int is_header(const char* line, const char* name) {
+    return strncasecmp(line, name, strlen(name)) == 0;
+}
+
+// translates the http/1.1 request header written by request()
+static void send_request(Quic* q) {
+    quiche_h3_header headers[40];
+    size_t n = 0, N = sizeof(headers) / sizeof(headers[0]);
+    char* line = q->head;
+    char* method = strtok(line, " ");
+    char* target = strtok(NULL, " ");
+    int fin = 1;
+    if (!method || !target || strtok(NULL, "\n") == NULL)
+        fail("error: invalid request", EUSAGE);
+    headers[n++] = (quiche_h3_header){(uint8_t*)":method", 7,
+        (uint8_t*)method, strlen(method)};
+    headers[n++] = (quiche_h3_header){(uint8_t*)":scheme", 7,
+        (uint8_t*)"https", 5};
+    headers[n++] = (quiche_h3_header){(uint8_t*)":path", 5,
+        (uint8_t*)target, strlen(target)};
+    while ((line = strtok(NULL, "\n")) && line[0] != '\r') {
+        char* colon = strchr(line, ':');
+        if (colon == NULL || n == N)
+            fail("error: invalid request header", EUSAGE);
+        char* value = colon + 1 + strspn(colon + 1, " \t");
+        value[strcspn(value, "\r")] = 0;
+        if (is_header(line, "Transfer-Encoding:"))
+            fail("error: chunked uploads are not supported over http/3",
+                 EUSAGE);
+        if (is_header(line, "Connection:"))
+            continue;  // connection specific headers are not allowed
+        if (is_header(line, "Content-Length:") && strtoull(value, NULL, 10))
+            fin = 0;   // the body follows
+        for (char* p = line; p < colon; p++)
+            *p = tolower((unsigned char)*p);
+        headers[n++] = is_header(line, "Host:") ?
+            (quiche_h3_header){(uint8_t*)":authority", 10, (uint8_t*)value,
+                               strlen(value)} :
+            (quiche_h3_header){(uint8_t*)line, colon - line, (uint8_t*)value,
+                               strlen(value)};
+    }
+    while ((q->stream = quiche_h3_send_request(q->h3, q->conn, headers, n,
+            fin)) == QUICHE_H3_ERR_STREAM_BLOCKED)
+        drive(q);
+    if (q->stream < 0)
+        fail("error: http/3 request failed", EPROTOCOL);
+    q->fin = fin;
+    flush_egress(q);
+}
+
+static ssize_t write_quic(void* cookie, const char* buf, size_t len) {
+    Quic* q = cookie;
+    size_t used = 0;
+    if (q->stream < 0) {  // the request header is sent once it is complete
+        size_t n = sizeof(q->head) - 1 - q->headlen;
+        n = len < n ? len : n;
+        memcpy(q->head + q->headlen, buf, n);
+        q->headlen += n;
+        q->head[q->headlen] = 0;
+        char* end = strstr(q->head, "\r\n\r\n");
+        if (end == NULL && q->headlen == sizeof(q->head) - 1)
+            fail("error: request too large", EUSAGE);
+        if (end == NULL)
+            return len;
+        used = (end + 4 - q->head) - (q->headlen - n);
+        send_request(q);
+        q->headlen = 0;
+    }
+    send_body(q, buf + used, len - used, 0);
+    return len;
+}
+
+static int add_header(uint8_t* name, size_t namelen, uint8_t* value,
+        size_t valuelen, void* cookie) {
+    Quic* q = cookie;
+    size_t n = q->headlen, N = sizeof(q->head) - 2;  // room for the last \r\n
+    if (namelen == 7 && memcmp(name, ":status", 7) == 0)
+        n += snprintf(q->head + n, n < N ? N - n : 0, "HTTP/3 %.*s\r\n",
+                      (int)valuelen, (char*)value);
+    else if (namelen > 0 && name[0] != ':')
+        n += snprintf(q->head + n, n < N ? N - n : 0, "%.*s: %.*s\r\n",
+                      (int)namelen, (char*)name, (int)valuelen, (char*)value);
+    q->headlen = n;
+    return 0;
+}
+
+// formats the response header like http/1.1 and skips 1xx responses other
+// than 100 Continue, which is only read after the previous head
+static void read_headers(Quic* q, quiche_h3_event* ev) {
+    if (q->final)
+        return;  // trailers
+    q->headlen = q->headpos = 0;
+    quiche_h3_event_for_each_header(ev, add_header, q);
+    if (q->headlen >= sizeof(q->head) - 2)
+        fail("error: response header too long", EPROTOCOL);
+    q->final = strncmp(q->head, "HTTP/3 1", 8) != 0;
+    if (!q->final && strncmp(q->head, "HTTP/3 100\r", 11) != 0)
+        q->headlen = 0;
+    else
+        q->headlen += snprintf(q->head + q->headlen, 3, "\r\n");
+}
+
+static int is_ready(Quic* q) {
+    return q->data || q->finished || q->headpos < q->headlen;
+}
+
+static void poll_events(Quic* q) {
+    quiche_h3_event* ev;
+    int64_t id;
+    while (!is_ready(q) &&
+            (id = quiche_h3_conn_poll(q->h3, q->conn, &ev)) >= 0) {
+        int type = quiche_h3_event_type(ev);
+        if (id == q->stream && type == QUICHE_H3_EVENT_HEADERS)
+            read_headers(q, ev);
+        else if (id == q->stream && type == QUICHE_H3_EVENT_DATA)
+            q->data = 1;
+        else if (id == q->stream && type == QUICHE_H3_EVENT_FINISHED)
+            q->finished = 1;
+        else if (id == q->stream && type == QUICHE_H3_EVENT_RESET)
+            fail("error: http/3 stream reset", EPROTOCOL);
+        quiche_h3_event_free(ev);
+    }
+}
+
+static ssize_t read_quic(void* cookie, char* buf, size_t len) {
+    Quic* q = cookie;
+    if (q->stream < 0)
+        fail("error: incomplete request", EUSAGE);
+    if (!q->fin && !q->waiting)
+        send_body(q, NULL, 0, 1);
+    while (1) {
+        if (q->headpos < q->headlen) {
+            size_t n = q->headlen - q->headpos < len ?
+                       q->headlen - q->headpos : len;
+            memcpy(buf, q->head + q->headpos, n);
+            q->headpos += n;
+            if (q->headpos == q->headlen && !q->final)
+                q->waiting = 0;  // the body follows the 100 Continue
+            return n;
+        }
+        if (q->data) {
+            ssize_t n = quiche_h3_recv_body(q->h3, q->conn, q->stream,
+                                            (uint8_t*)buf, len);
+            if (n > 0)
+                return n;
+            q->data = 0;  // wait for the next data event
+        }
+        if (q->finished)
+            return 0;
+        poll_events(q);
+        if (!is_ready(q))
+            drive(q);
+    }
+}
+
+int wait_quic(FILE* file, int ms) {
+    // waits up to ms for a response header before the body is sent, and
+    // then holds back the end of the body until read_quic has returned it
+    Quic* q = NULL;
+    for (size_t i = 0; i < sizeof(streams) / sizeof(streams[0]); i++)
+        q = streams[i] && streams[i]->file == file ? streams[i] : q;
+    if (q == NULL || q->stream < 0)
+        return 0;
+    for (long long end = now_ms() + ms;;) {
+        poll_events(q);
+        if (q->headpos < q->headlen || q->finished)
+            return q->waiting = 1;
+        if (now_ms() >= end)
+            return 0;
+        flush_egress(q);
+        wait_ingress(q, end - now_ms());
+        if (quiche_conn_is_closed(q->conn))
+            fail("error: quic connection closed", EPROTOCOL);
+    }
+}
+
+static int end_quic(void* cookie) {
+    Quic* q = cookie;
+    const uint8_t* session = NULL;
+    size_t len = 0;
+    quiche_conn_session(q->conn, &session, &len);
+    int fd = len > 0 && q->session[0] ?
+             open(q->session, O_WRONLY | O_CREAT | O_TRUNC, 0600) : -1;
+    FILE* file = fd == -1 ? NULL : fdopen(fd, "w");
+    if (file) {  // for 0-rtt resumption by the next request
+        fwrite(session, 1, len, file);
+        fclose(file);
+    }
+    quiche_conn_close(q->conn, true, 0, NULL, 0);
+    flush_egress(q);
+    if (q->h3)
+        quiche_h3_conn_free(q->h3);
+    quiche_h3_config_free(q->h3config);
+    quiche_conn_free(q->conn);
+    for (size_t i = 0; i < sizeof(streams) / sizeof(streams[0]); i++)
+        streams[i] = streams[i] == q ? NULL : streams[i];
+    quiche_config_free(q->config);
+    close(q->fd);
+    free(q);
+    return 0;
+}
+
+static quiche_config* new_config(const char* cacerts, int insecure,
+        int timeout) {
+    quiche_config* config = quiche_config_new(QUICHE_PROTOCOL_VERSION);
+    if (config == NULL)
+        fail("error: failed to create quic config", ESYSTEM);
+    quiche_config_set_application_protos(config,
+        (const uint8_t*)QUICHE_H3_APPLICATION_PROTOCOL,
+        sizeof(QUICHE_H3_APPLICATION_PROTOCOL) - 1);
+    quiche_config_set_max_idle_timeout(config, timeout ? timeout * 1000 :
+                                       30000);
+    quiche_config_set_max_recv_udp_payload_size(config, DATAGRAM);
+    quiche_config_set_max_send_udp_payload_size(config, DATAGRAM);
+    quiche_config_set_initial_max_data(config, 16 << 20);
+    quiche_config_set_initial_max_stream_data_bidi_local(config, 16 << 20);
+    quiche_config_set_initial_max_stream_data_uni(config, 1 << 20);
+    quiche_config_set_initial_max_streams_bidi(config, 16);
+    quiche_config_set_initial_max_streams_uni(config, 16);
+    quiche_config_set_disable_active_migration(config, true);
+    quiche_config_enable_early_data(config);
+    quiche_config_verify_peer(config, !insecure);
+    if (!insecure && cacerts && (isdir(cacerts) ?
+            quiche_config_load_verify_locations_from_directory(config,
+                cacerts) : quiche_config_load_verify_locations_from_file(
+                config, cacerts)) != 0)
+        fail("failed to load CA certificates", EUSAGE);
+    return config;
+}
+
+static void resume_session(Quic* q, const char* host, const char* port) {
+    char name[320];
+    uint8_t session[8192];
+    snprintf(name, sizeof(name), "h3-%s:%s", host, port);
+    if (get_cache_path(q->session, sizeof(q->session), name) == NULL) {
+        q->session[0] = 0;
+        return;
+    }
+    FILE* file = fopen(q->session, "r");
+    size_t n = file ? fread(session, 1, sizeof(session), file) : 0;
+    if (file)
+        fclose(file);
+    if (n > 0 && n < sizeof(session))
+        quiche_conn_set_session(q->conn, session, n);  // allows 0-rtt
+}
+
+FILE* start_quic(struct sockaddr_storage* addr, socklen_t len,
+        const char* host, const char* port, const char* cacerts, int insecure,
+        int timeout, int early) {
+    uint8_t scid[16];
+    Quic* q = calloc(1, sizeof(Quic));
+    FILE* random = fopen("/dev/urandom", "r");
+    if (q == NULL || random == NULL || fread(scid, 1, 16, random) != 16)
+        sfail("quic setup failed");
+    fclose(random);
+    q->stream = -1;
+    q->peerlen = len;
+    q->locallen = sizeof(q->local);
+    memcpy(&q->peer, addr, len);
+    q->fd = socket(addr->ss_family, SOCK_DGRAM, 0);
+    if (q->fd == -1 || connect(q->fd, (struct sockaddr*)addr, len) != 0 ||
+            getsockname(q->fd, (struct sockaddr*)&q->local, &q->locallen) ||
+            fcntl(q->fd, F_SETFL, O_NONBLOCK) == -1)
+        sfail("udp socket failed");
+
+    q->config = new_config(cacerts, insecure, timeout);
+    q->conn = quiche_connect(host, scid, sizeof(scid),
+        (struct sockaddr*)&q->local, q->locallen,
+        (struct sockaddr*)&q->peer, q->peerlen, q->config);
+    if (q->conn == NULL)
+        fail("error: quic connect failed", ESYSTEM);
+    resume_session(q, host, port);
+
+    // with a resumed session the request is sent as 0-rtt early data, but
+    // only if it is safe to replay
+    trace_begin("quic");
+    long long deadline = now_ms() + (timeout ? timeout * 1000 : HANDSHAKE_MS);
+    while (!quiche_conn_is_established(q->conn) &&
+            !(early && quiche_conn_is_in_early_data(q->conn)) &&
+            !quiche_conn_is_closed(q->conn) && now_ms() < deadline) {
+        flush_egress(q);
+        wait_ingress(q, deadline - now_ms());
+    }
+    trace_end("quic");
+    q->h3config = quiche_h3_config_new();
+    if (!quiche_conn_is_established(q->conn) &&
+            !(early && quiche_conn_is_in_early_data(q->conn))) {
+        q->session[0] = 0;
+        end_quic(q);
+        return NULL;  // udp is probably blocked, so use tcp instead
+    }
+    q->h3 = quiche_h3_conn_new_with_transport(q->conn, q->h3config);
+    if (q->h3config == NULL || q->h3 == NULL)
+        fail("error: http/3 setup failed", EPROTOCOL);
+    q->file = fopencookie(q, "r+",
+        (cookie_io_functions_t){read_quic, write_quic, NULL, end_quic});
+    for (size_t i = 0; i < sizeof(streams) / sizeof(streams[0]); i++) {
+        if (q->file && streams[i] == NULL) {
+            streams[i] = q;
+            break;
+        }
+    }
+    return q->file;
+}
+
+static void get_origin(char* origin, URL url) {
+    snprintf(origin, 320, "%s:%s", url.host, url.port[0] ? url.port : "443");
+}
+
+// finds the "<host>:<port> <udp port> <expires>" line of an origin that has
+// not expired, where udp port 0 marks http/3 as broken
+static int find_alt_svc(const char* origin, char* port) {
+    char path[PATH_MAX], line[512], name[320];
+    long long expires = 0;
+    FILE* file = get_cache_path(path, sizeof(path), "alt-svc") ?
+                 fopen(path, "r") : NULL;
+    int found = 0;
+    while (file && !found && fgets(line, sizeof(line), file))
+        found = sscanf(line, "%319s %15s %lld", name, port, &expires) == 3 &&
+                strcmp(name, origin) == 0 && expires > time(NULL);
+    if (file)
+        fclose(file);
+    return found;
+}
+
+static void put_alt_svc(const char* origin, long port, long long expires) {
+    // replaces the line of the origin, or removes it if expires is 0
+    char path[PATH_MAX], temp[PATH_MAX + 32], line[512];
+    if (get_cache_path(path, sizeof(path), "alt-svc") == NULL)
+        return;
+    snprintf(temp, sizeof(temp), "%s.%ld", path, (long)getpid());
+    FILE* out = fopen(temp, "w");
+    FILE* in = out ? fopen(path, "r") : NULL;
+    if (out == NULL)
+        return;
+    size_t n = strlen(origin);
+    while (in && fgets(line, sizeof(line), in))
+        if (strncmp(line, origin, n) != 0 || line[n] != ' ')
+            fputs(line, out);
+    if (expires > 0)
+        fprintf(out, "%s %ld %lld\n", origin, port, expires);
+    if (in)
+        fclose(in);
+    if (fclose(out) != 0 || rename(temp, path) != 0)
+        unlink(temp);
+}
+
+char* get_alt_svc(URL url, int force) {
+    // returns the udp port to use for http/3, or NULL to use tcp
+    static char port[16];
+    char origin[320];
+    if (strcmp(url.scheme, "https") != 0)
+        return NULL;
+    if (force)
+        return url.port[0] ? url.port : "443";
+    get_origin(origin, url);
+    return find_alt_svc(origin, port) && strcmp(port, "0") != 0 ? port : NULL;
+}
+
+void break_alt_svc(URL url) {
+    // after a fallback to tcp, http/3 is not tried again for a while, even
+    // if the server keeps advertising it
+    char origin[320];
+    get_origin(origin, url);
+    put_alt_svc(origin, 0, (long long)time(NULL) + BROKEN_S);
+}
+
+void keep_alt_svc(URL url, char* header) {
+    char origin[320], port[16];
+    char* value = get_header(header, "Alt-Svc:");
+    char* h3 = value ? strstr(value, "h3=\":") : NULL;
+    if (value == NULL || strcmp(url.scheme, "https") != 0 ||
+            (h3 == NULL && strncmp(value, "clear", 5) != 0))
+        return;  // only alternatives on the same host are used
+    char* end = h3 ? h3 + strcspn(h3, ",\r\n") : NULL;
+    char* ma = h3 ? strstr(h3, "ma=") : NULL;
+    long long age = ma && ma < end ? strtoll(ma + 3, NULL, 10) : 86400;
+    long udp = h3 ? strtol(h3 + 5, NULL, 10) : 0;
+    get_origin(origin, url);
+    if (h3 && find_alt_svc(origin, port) && strcmp(port, "0") == 0)
+        return;  // broken until it expires
+    put_alt_svc(origin, udp, udp > 0 && udp < 65536 ?
+                (long long)time(NULL) + age : 0);
+}
@@ -0,0 +1,16 @@
+#ifdef QUIC
+FILE* start_quic(struct sockaddr_storage* addr, socklen_t len,
+        const char* host, const char* port, const char* cacerts, int insecure,
+        int timeout, int early);
+char* get_alt_svc(URL url, int force);
+void break_alt_svc(URL url);
+void keep_alt_svc(URL url, char* header);
+int wait_quic(FILE* file, int ms);
+#else
+#define start_quic(...) NULL
+#define get_alt_svc(url, force) \
+    ((force) ? fail("error: http/3 not supported", EUSAGE) : NULL)
+#define break_alt_svc(...) (void)0
+#define keep_alt_svc(...) (void)0
+#define wait_quic(file, ms) 0
+#endif
@@ -1,19 +1,45 @@
 #define _POSIX_C_SOURCE 200112L
 #include <stdio.h>
+#include <stdlib.h>
 #include <string.h>
+#include <stdint.h>   // SIZE_MAX
 #include <time.h>
+#include <unistd.h>
+#include <fcntl.h>
 #include <inttypes.h> // intmax_t
 #include <sys/stat.h>
 #include "util.h"
 #include "request.h"
+#include "gzip.h"
 
-static void swritefile(FILE* sock, const char* path, char* buf) {
-    FILE* file = fopen(path, "r");
-    if (!file)
+// a part is "<first>-<last>/<length>", as in a Content-Range header
+static off_t get_part(char* part, size_t* len) {
+    char* end = NULL;
+    long long first = strtoll(part, &end, 10);
+    long long last = *end == '-' ? strtoll(end + 1, NULL, 10) : -1;
+    if (first < 0 || last < first)
+        fail("error: invalid upload part", EUSAGE);
+    *len = last - first + 1;
+    return first;
+}
+
+static void swritefile(FILE* sock, const char* path, char* part, char* buf) {
+    size_t len = SIZE_MAX, N = BUFSIZE;
+    int fd = open(path, O_RDONLY);
+    if (fd == -1)
         sfail("failed to open upload file");
-    for (size_t n = 0; (n = fread(buf, 1, BUFSIZE, file)) > 0;)
-        if (fwrite(buf, 1, n, sock) != n)
+    // each part is sent by its own process with its own file offset
+    if (part && lseek(fd, get_part(part, &len), SEEK_SET) == -1)
+        sfail("failed to seek upload file");
+    for (ssize_t n = 1; len > 0 && n > 0; len -= n) {
+        if ((n = read(fd, buf, len < N ? len : N)) < 0)
+            sfail("failed to read upload file");
+        if (fwrite(buf, 1, n, sock) != (size_t)n)
             sfail("send failed");
+    }
+    if (part && len > 0)
+        fail("error: upload file is shorter than the part", EUSAGE);
+    close(fd);
 }
 
 static size_t base64encode(const char* in, size_t n, char* out) {
@@ -37,15 +63,20 @@ static size_t write_auth(char* buffer, size_t N, char* name, char* auth) {
     return n;
 }
 
-static size_t get_content_length(char* body, char* upload) {
+static size_t get_content_length(char* body, char* upload, char* part) {
+    size_t len = 0;
     if (body || !upload)
         return body ? strlen(body) : 0;
-    return get_file_size(upload);
+    if (!part)
+        return get_file_size(upload);
+    get_part(part, &len);
+    return len;
 }
 
 void request(char* buffer, FILE* sock, URL url, URL proxy, char* auth,
-        char* method, char** headers, char* body, char* upload, char* dest,
-        char* newer, int resume, int verbose, int zip) {
+        char* method, char** headers, char* body, char* upload, char* part,
+        char* dest, char* newer, int resume, char* etag, char* range,
+        int verbose, int zip, int compress, int expect) {
     struct stat sb;
     char time[32];
     size_t n = 0, N = BUFSIZE;
@@ -89,13 +120,33 @@ void request(char* buffer, FILE* sock, URL url, URL proxy, char* auth,
         strftime(time, sizeof(time), "%a, %d %b %Y %H:%M:%S GMT", timeinfo);
         n += snprintf(buffer + n, n < N ? N - n : 0,
                 "Range: bytes=%jd-\r\n", (intmax_t)sb.st_size);
-        n += snprintf(buffer + n, n < N ? N - n : 0, "If-Range: %s\r\n", time);
+        // an entity tag is a stronger validator than the file time
+        n += snprintf(buffer + n, n < N ? N - n : 0, "If-Range: %s\r\n",
+                etag ? etag : time);
     }
+    if (range) {
+        n += snprintf(buffer + n, n < N ? N - n : 0, "Range: bytes=%s\r\n",
+                range);
+        // a file that changed since etag is sent whole and then rejected
+        if (etag)
+            n += snprintf(buffer + n, n < N ? N - n : 0, "If-Range: %s\r\n",
+                    etag);
+    }
+    if (upload && part)
+        n += snprintf(buffer + n, n < N ? N - n : 0,
+                "Content-Range: bytes %s\r\n", part);
     while (*headers != NULL)
         n += snprintf(buffer + n, n < N ? N - n : 0, "%s\r\n", *(headers++));
-    if (body || upload)
+    if (expect && (body || upload))
         n += snprintf(buffer + n, n < N ? N - n : 0,
-                "Content-Length: %zu\r\n", get_content_length(body, upload));
+                "Expect: 100-continue\r\n");
+    if (upload && compress)  // the compressed length is not known in advance
+        n += snprintf(buffer + n, n < N ? N - n : 0, "Content-Encoding: gzip"
+                "\r\nTransfer-Encoding: chunked\r\n");
+    else if (body || upload)
+        n += snprintf(buffer + n, n < N ? N - n : 0,
+                "Content-Length: %zu\r\n",
+                get_content_length(body, upload, part));
     n += snprintf(buffer + n, n < N ? N - n : 0, "\r\n");
 
     if (n >= N)  // equal is a failure because of null terminator
@@ -107,18 +158,29 @@ void request(char* buffer, FILE* sock, URL url, URL proxy, char* auth,
         fputs("======================= END =======================\n", stderr);
     }
 
-    if (body && strlen(body) < (n < N ? N - n : 0)) {
+    if (expect && (body || upload)) {
+        swrite(sock, buffer);  // the body waits for 100 Continue
+        if (fflush(sock) != 0)
+            sfail("send failed");
+    } else if (body && strlen(body) < (n < N ? N - n : 0)) {
         n += snprintf(buffer + n, n < N ? N - n : 0, "%s", body);
         swrite(sock, buffer);  // write header and body
     } else {
         swrite(sock, buffer);  // write header
-        if (body)
-            swrite(sock, body);
-        else if (upload)
-            swritefile(sock, upload, buffer);
+        send_body(buffer, sock, body, upload, part, compress);
     }
 }
 
+void send_body(char* buffer, FILE* sock, char* body, char* upload,
+        char* part, int compress) {
+    if (body)
+        swrite(sock, body);
+    else if (upload && compress)
+        send_gzip(sock, upload, compress);
+    else if (upload)
+        swritefile(sock, upload, part, buffer);
+}
+
 void send_proxy_connect(char* buffer, FILE* sock, URL url, URL proxy) {
     size_t n = 0, N = BUFSIZE;
     int url_https = strcmp(url.scheme, "https") == 0;
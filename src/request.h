@@ -1,4 +1,7 @@
 void request(char* buffer, FILE* sock, URL url, URL proxy, char* auth,
-             char* method, char** headers, char* body, char* upload, char* dest,
-             char* newer, int resume, int verbose, int zip);
+             char* method, char** headers, char* body, char* upload,
+             char* part, char* dest, char* newer, int resume, char* etag,
+             char* range, int verbose, int zip, int compress, int expect);
+void send_body(char* buffer, FILE* sock, char* body, char* upload,
+               char* part, int compress);
 void send_proxy_connect(char* buffer, FILE* sock, URL url, URL proxy);
@@ -1,11 +1,23 @@
 #define _POSIX_C_SOURCE 200112L
+#define _GNU_SOURCE   // splice (linux)
 #include <stdio.h>
 #include <stdlib.h>
+#include <stdint.h>   // SIZE_MAX
 #include <string.h>
 #include <strings.h>  // strncasecmp
+#include <ctype.h>    // isdigit
+#include <limits.h>   // LONG_MAX
 #include <unistd.h>   // access
+#include <time.h>
+#include <errno.h>
+#include <fcntl.h>
+#include <sys/uio.h>  // writev
+#include <sys/socket.h>
 #include "util.h"
 #include "response.h"
+#include "store.h"
+#include "trace.h"
+#include "quic.h"
 
 static size_t min(size_t a, size_t b) {
     return a < b ? a : b;
@@ -72,8 +84,21 @@ char* get_header(char* response, char* name) {
     return NULL;
 }
 
+static FILE* open_ranges(char* dest) {
+    // the ranges are written in place, so the file is not truncated
+    if (is_stdout(dest))
+        return stdout;
+    int fd = isdir(dest) ? -1 : open(dest, O_WRONLY | O_CREAT, 0666);
+    FILE* out = fd == -1 ? NULL : fdopen(fd, "w");
+    if (out == NULL)
+        sfail("open failed");
+    return out;
+}
+
 static FILE* open_file(char* dest, int status_code, char* header, int resume,
-        URL url) {
+        char* etag, char* ranges, URL url, char* store) {
+    if (ranges)
+        return open_ranges(dest);
     if (status_code == 206) {
         if (!resume)
             fail("error: unexpected partial content response", EPROTOCOL);
@@ -90,7 +115,7 @@ static FILE* open_file(char* dest, int status_code, char* header, int resume,
         if (out == NULL)
             sfail("open failed");
         return out;
-    } else if (resume)
+    } else if (resume && !etag)
         fail("error: resume not supported or source file modified", EPROTOCOL);
 
     if (is_stdout(dest))
@@ -102,8 +127,15 @@ static FILE* open_file(char* dest, int status_code, char* header, int resume,
             dest = "index.html";
     }
 
-    if (access(dest, F_OK) == 0)
+    // a retry that resumes by etag restarts the file if the etag changed
+    if (!resume && access(dest, F_OK) == 0)
         fail("error: output file already exists", EUSAGE);
+    if (store && status_code == 200) {
+        int hit = 0;
+        FILE* out = open_store(store, url, header, dest, &hit);
+        if (out || hit)
+            return out;
+    }
     FILE* out = fopen(dest, "w");
     if (out == NULL)
         sfail("open failed");
@@ -121,13 +153,77 @@ static size_t read_head(FILE* sock, char* buf, size_t len) {
     return 0;
 }
 
-static size_t write_body(FILE* sock, char* buffer, FILE* out, FILE* bar) {
+#ifdef SPLICE_F_MOVE
+static void drain_pipe(int pipefd, char* buffer, size_t len, int fd) {
+    // the output does not support splice, so copy what is left in the pipe
+    for (ssize_t n = 0; len > 0; len -= n)
+        if ((n = read(pipefd, buffer, min(len, BUFSIZE))) <= 0 ||
+                write(fd, buffer, n) != n)
+            sfail("write failed");
+}
+
+// moves the body from the socket to the output within the kernel after
+// writing out what stdio has already buffered, and returns the number of
+// bytes moved (the caller reads the rest if splice stops early)
+static size_t splice_body(FILE* sock, char* buffer, FILE* out, size_t size,
+        FILE* bar) {
+    int fd = fileno(sock), outfd = fileno(out), flags = fcntl(fd, F_GETFL);
+    int pipefd[2] = {0, 0};
+    size_t progress = 0;
+    if (flags == -1 || (fcntl(outfd, F_GETFL) & O_APPEND) ||
+            fcntl(fd, F_SETFL, flags | O_NONBLOCK) == -1)
+        return 0;  // splice does not support files opened for appending
+    for (size_t n = 1; n > 0 && progress < size; progress += n) {
+        n = fread(buffer, 1, min(size - progress, BUFSIZE), sock);
+        write_body_span(out, buffer, n, progress, size, bar);
+    }
+    if (ferror(sock) && errno != EAGAIN && errno != EWOULDBLOCK)
+        sfail("receive failed");
+    clearerr(sock);
+    if (fflush(out) != 0)
+        sfail("write failed");
+    if (fcntl(fd, F_SETFL, flags) == -1 || pipe(pipefd) != 0)
+        return progress;  // the caller copies the rest
+    while (progress < size) {
+        ssize_t n = splice(fd, NULL, pipefd[1], NULL, min(size - progress,
+                           1 << 20), SPLICE_F_MOVE | SPLICE_F_MORE);
+        if (n < 0 && errno == EINTR)
+            continue;
+        if (n < 0 && errno != EINVAL && errno != ENOSYS)
+            sfail("receive failed");
+        if (n <= 0)
+            break;  // not supported by the socket (or the end of the body)
+        for (ssize_t m = 0, k = n; k > 0; k -= m) {
+            m = splice(pipefd[0], NULL, outfd, NULL, k, SPLICE_F_MOVE);
+            if (m < 0 && errno != EINVAL && errno != ENOSYS && errno != EINTR)
+                sfail("write failed");
+            if (m <= 0)  // not supported by the output
+                drain_pipe(pipefd[0], buffer, k, outfd), m = k;
+        }
+        if (bar)
+            fprintf(bar, "%zu %zu\n", progress + n, size);
+        progress += n;
+    }
+    close(pipefd[0]);
+    close(pipefd[1]);
+    return progress;
+}
+#else
+#define splice_body(...) 0
+#endif
+
+static size_t write_body(FILE* sock, char* buffer, FILE* out, FILE* bar,
+        int zerocopy) {
     size_t N = BUFSIZE;
     char* length = get_header(buffer, "Content-Length:");
     size_t size = length ? strtoll(length, NULL, 10) : 0;
-    if (size == 0 && length[0] == '0')
+    if (size == 0 && length && length[0] == '0')
         return 0;
     size_t progress = 0;
+    // tls streams are decrypted in this process, so only plain http bodies
+    // can move within the kernel
+    if (zerocopy && size > 0 && fileno(sock) != -1)
+        progress = splice_body(sock, buffer, out, size, bar);
     for (size_t n = 1; n > 0 && (size == 0 || progress < size); progress += n) {
         n = sread(sock, buffer, size ? min(size - progress, N) : N);
         write_body_span(out, buffer, n, progress, size, bar);
@@ -137,12 +233,17 @@ static size_t write_body(FILE* sock, char* buffer, FILE* out, FILE* bar) {
     return progress;
 }
 
+static size_t parse_chunk_size(char* line, size_t len) {
+    size_t size = (size_t)strtoul(line, NULL, 16);
+    if (len == 0 || (size == 0 && line[0] != '0'))
+        fail("error: invalid chunked encoding (no terminator)", EPROTOCOL);
+    return size;
+}
+
 static size_t write_chunk(FILE* sock, char* buffer, FILE* out) {
     size_t N = BUFSIZE;
     size_t n = sreadln(sock, buffer, N);
-    size_t size = (size_t)strtoul(buffer, NULL, 16);
-    if (size == 0 && buffer[0] != '0')
-        fail("error: invalid chunked encoding (no terminator)", EPROTOCOL);
+    size_t size = parse_chunk_size(buffer, n);
     if (size == 0)
         return 0;
     size_t progress = 0;
@@ -158,10 +259,59 @@ static size_t write_chunk(FILE* sock, char* buffer, FILE* out) {
     return size;
 }
 
-static size_t write_chunks(FILE* sock, char* buffer, FILE* out) {
+static void write_gathered(FILE* out, struct iovec* iov, int count) {
+    while (count > 0) {
+        ssize_t n = writev(fileno(out), iov, count);
+        if (n < 0)
+            sfail("write failed");
+        for (; count > 0 && (size_t)n >= iov->iov_len; count--, iov++)
+            n -= iov->iov_len;
+        if (count > 0) {
+            iov->iov_base = (char*)iov->iov_base + n;
+            iov->iov_len -= n;
+        }
+    }
+}
+
+// reads chunks into a block until it is full and then writes the payloads
+// in the block with one gathered write instead of one write per chunk;
+// reads never go past the current chunk so the response end is not awaited
+static size_t write_chunk_blocks(FILE* sock, char* buffer, FILE* out) {
+    struct iovec iov[256];
+    char line[BUFSIZE];  // chunk extensions can make size lines long
+    size_t N = BUFSIZE, len = 0, total = 0;
+    int count = 0, M = sizeof(iov) / sizeof(iov[0]);
+    if (fflush(out) != 0)  // the response header may be buffered
+        sfail("write failed");
+    for (size_t size = 1; size > 0; total += size) {
+        size = parse_chunk_size(line, sreadln(sock, line, sizeof(line)));
+        for (size_t left = size ? size + 2 : 0, m = 0; left > 0; left -= m) {
+            if (len == N || count == M) {
+                write_gathered(out, iov, count);
+                len = count = 0;
+            }
+            m = sread(sock, buffer + len, min(left, N - len));
+            if (m == 0)
+                fail("error: invalid chunked encoding (incorrect length)",
+                     EPROTOCOL);
+            size_t payload = min(m, left - min(left, 2));
+            if (payload > 0)
+                iov[count++] = (struct iovec){buffer + len, payload};
+            len += m;
+        }
+        if (size > 0 && buffer[len - 1] != '\n')
+            fail("error: invalid chunked encoding (missing \\r\\n)", EPROTOCOL);
+    }
+    write_gathered(out, iov, count);
+    return total;
+}
+
+static size_t write_chunks(FILE* sock, char* buffer, FILE* out, int flush) {
+    if (!flush)
+        return write_chunk_blocks(sock, buffer, out);
     size_t n = 0;
     for (size_t m = 1; m > 0; n += m)
-        m = write_chunk(sock, buffer, out);
+        m = write_chunk(sock, buffer, out);  // flushes each chunk
     return n;
 }
 
@@ -176,6 +326,149 @@ static int is_chunked(char* header) {
     return strncasecmp(encoding, "chunked", 7) == 0;
 }
 
+static size_t seek_range(FILE* out, char* range) {
+    // "Content-Range: bytes <first>-<last>/<length>"
+    char* end = NULL;
+    if (!range || strncasecmp(range, "bytes ", 6) != 0)
+        fail("error: missing content-range header", EPROTOCOL);
+    long long first = strtoll(range + 6, &end, 10);
+    long long last = *end == '-' ? strtoll(end + 1, NULL, 10) : -1;
+    if (first < 0 || last < first)
+        fail("error: invalid content-range header", EPROTOCOL);
+    if (out != stdout && fseeko(out, first, SEEK_SET) != 0)
+        sfail("seek failed");
+    return last - first + 1;
+}
+
+// parses a multipart/byteranges body as it is fed, so that chunked bodies
+// are decoded and each part written in a single pass
+typedef struct {
+    FILE* out;
+    char delimiter[80], line[BUFSIZE];
+    size_t n, len, mark, left;  // line holds the delimiter and part header
+    int head, done;
+} Parts;
+
+static void feed_parts(Parts* parts, char* data, size_t size) {
+    while (size > 0 && !parts->done) {
+        if (parts->left > 0) {  // inside a part
+            size_t m = min(parts->left, size);
+            write_out(parts->out, data, m);
+            parts->left -= m, data += m, size -= m;
+            continue;
+        }
+        char* end = memchr(data, '\n', size);
+        size_t m = end ? (size_t)(end - data) + 1 : size;
+        if (parts->len + m >= sizeof(parts->line))
+            fail("error: invalid multipart response", EPROTOCOL);
+        memcpy(parts->line + parts->len, data, m);
+        parts->len += m, data += m, size -= m;
+        if (end == NULL)
+            continue;
+        char* line = parts->line + parts->mark;
+        parts->line[parts->len] = 0;
+        if (parts->head && strcmp(line, "\r\n") == 0) {
+            parts->left = seek_range(parts->out, get_header(parts->line,
+                                     "Content-Range:"));
+            parts->head = 0, parts->len = parts->mark = 0;
+        } else if (parts->head) {
+            parts->mark = parts->len;
+        } else if (strncmp(line, parts->delimiter, parts->n) != 0) {
+            parts->len = 0;  // preamble or the line break after a part
+        } else if (strncmp(line + parts->n, "--", 2) == 0) {
+            parts->done = 1;  // close delimiter
+        } else {
+            parts->head = 1, parts->mark = parts->len;
+        }
+    }
+}
+
+static void feed_chunks(FILE* sock, char* buffer, Parts* parts) {
+    for (size_t size = 1, n = 0; size > 0;) {
+        size = parse_chunk_size(buffer, sreadln(sock, buffer, BUFSIZE));
+        for (size_t left = size ? size + 2 : 0; left > 0; left -= n) {
+            if ((n = sread(sock, buffer, min(left, BUFSIZE))) == 0)
+                fail("error: invalid chunked encoding (incorrect length)",
+                     EPROTOCOL);
+            feed_parts(parts, buffer, min(n, left - min(left, 2)));
+        }
+        if (size > 0 && buffer[n - 1] != '\n')
+            fail("error: invalid chunked encoding (missing \\r\\n)", EPROTOCOL);
+    }
+}
+
+// writes each part of a 206 response at its offset in the output (or in
+// order to stdout)
+static void write_ranges(FILE* sock, char* buffer, FILE* out, int flush) {
+    Parts parts = {.out = out};
+    char* type = get_header(buffer, "Content-Type:");
+    char* boundary = type && strncasecmp(type, "multipart/byteranges", 20) == 0
+        ? strstr(type, "boundary=") : NULL;
+    if (boundary == NULL) {
+        seek_range(out, get_header(buffer, "Content-Range:"));
+        if (is_chunked(buffer))
+            write_chunks(sock, buffer, out, flush);
+        else
+            write_body(sock, buffer, out, NULL, 0);
+        return;
+    }
+    boundary += 9 + (boundary[9] == '"');
+    parts.n = snprintf(parts.delimiter, sizeof(parts.delimiter), "--%.*s",
+                       (int)strcspn(boundary, "\"\r\n; "), boundary);
+    if (parts.n >= sizeof(parts.delimiter))
+        fail("error: invalid multipart boundary", EPROTOCOL);
+    char* length = get_header(buffer, "Content-Length:");
+    size_t size = length ? strtoull(length, NULL, 10) : SIZE_MAX;
+    if (is_chunked(buffer))
+        feed_chunks(sock, buffer, &parts);
+    else
+        for (size_t n = 1; n > 0 && size > 0 && !parts.done; size -= n) {
+            n = sread(sock, buffer, min(size, BUFSIZE));
+            feed_parts(&parts, buffer, n);
+        }
+    if (!parts.done)
+        fail("error: invalid multipart response", EPROTOCOL);
+}
+
+static long long get_http_time(char* date) {
+    // "Sun, 06 Nov 1994 08:49:37 GMT" (the IMF-fixdate of RFC 9110 5.6.7)
+    static const char* months = "JanFebMarAprMayJunJulAugSepOctNovDec";
+    char month[4] = "";
+    int d = 0, y = 0, h = 0, m = 0, s = 0;
+    char* p = NULL;
+    if (!date || sscanf(date, "%*3s, %2d %3s %4d %2d:%2d:%2d GMT", &d, month,
+            &y, &h, &m, &s) != 6 || !(p = strstr(months, month)) ||
+            (p - months) % 3 != 0)
+        return -1;
+    // days since 1970 (https://howardhinnant.github.io/date_algorithms.html)
+    long long mon = (p - months) / 3, era = (y - (mon < 2)) / 400;
+    long long yoe = (y - (mon < 2)) - era * 400;
+    long long doy = (153 * (mon < 2 ? mon + 10 : mon - 2) + 2) / 5 + d - 1;
+    long long days = era * 146097 + yoe * 365 + yoe/4 - yoe/100 + doy - 719468;
+    return ((days * 24 + h) * 60 + m) * 60 + s;
+}
+
+static long get_retry_after(char* header) {
+    // seconds, or a date that is compared with the date of the response
+    char* after = get_header(header, "Retry-After:");
+    if (after && isdigit((unsigned char)after[0]))
+        return strtol(after, NULL, 10);
+    long long when = get_http_time(after);
+    long long date = get_http_time(get_header(header, "Date:"));
+    if (when < 0)
+        return -1;
+    when -= date >= 0 ? date : (long long)time(NULL);
+    return when > 0 ? (when < LONG_MAX ? (long)when : LONG_MAX) : 0;
+}
+
+static void write_report(FILE* report, char* header, int status_code) {
+    // one line per response: status code, retry-after seconds, entity tag
+    char* etag = get_header(header, "ETag:");
+    fprintf(report, "%d %ld %.*s\n", status_code, get_retry_after(header),
+            etag ? (int)strcspn(etag, "\r\n") : 0, etag ? etag : "");
+    fflush(report);
+}
+
 static void print_status_line(char* response) {
     char* space = strchr(response, ' ');
     if (space == NULL)
@@ -185,30 +478,67 @@ static void print_status_line(char* response) {
 }
 
 int handle_response(char* buffer, FILE* sock, URL url, char* dest, int resume,
-        char* method, int entire, int direct, int lax, int zip, FILE* bar) {
-    size_t headlen = read_head(sock, buffer, BUFSIZE);
-    int status_code = parse_status_line(buffer);
-    if (status_code/100 == 2 || (direct && status_code/100 == 3) ||
-            (lax && (status_code/100 != 3 || status_code == 304))) {
+        char* etag, char* range, char* method, int expect, int waiting,
+        int entire, int direct, int lax, int zip, int flush, int zerocopy,
+        char* store, FILE* bar, FILE* report) {
+    size_t headlen = 0;
+    int status_code = 0;
+    trace_begin("header");
+    // interim responses are skipped, except for the 100 Continue that a
+    // request body is waiting for (101 is not expected without Upgrade)
+    do {
+        headlen = read_head(sock, buffer, BUFSIZE);
+        status_code = parse_status_line(buffer);
+    } while (status_code/100 == 1 && status_code != 101 &&
+             !(waiting && status_code == 100));
+    trace_end("header");
+    if (status_code == 100)
+        return status_code;
+    keep_alt_svc(url, buffer);
+    int output = status_code/100 == 2 || (direct && status_code/100 == 3) ||
+            (lax && (status_code/100 != 3 || status_code == 304));
+    if (report && !output)
+        write_report(report, buffer, status_code);
+    if (output) {
         char* encoding = get_header(buffer, "Content-Encoding:");
         if (zip && (!encoding || strncmp(encoding, "gzip\r\n", 6) != 0))
             fail("error: server does not support gzip", EPROTOCOL);
         if (!zip && encoding && strncmp(encoding, "identity\r\n", 10) != 0)
             fail("error: unexpected content encoding", EPROTOCOL);
+        if (range && status_code == 200 && is_stdout(dest) && !lax)
+            fail("error: server does not support byte ranges", EPROTOCOL);
+        // a range must come from the version of the file that etag names
+        // (servers that ignore If-Range send a different etag)
+        char* tag = get_header(buffer, "ETag:");
+        if (range && etag && !lax && (status_code == 200 || !tag ||
+                strncmp(tag, etag, strlen(etag)) != 0 ||
+                tag[strlen(etag)] != '\r'))
+            fail("error: file changed on the server", EPROTOCOL);
 
-        FILE* out = open_file(dest, status_code, buffer, resume, url);
+        FILE* out = open_file(dest, status_code, buffer, resume, etag, range,
+                              url, entire || range ? NULL : store);
+        if (report)  // after the checks, so that only the body can fail
+            write_report(report, buffer, status_code);
+        if (out == NULL)
+            return status_code;  // linked from the store
         if (entire)
             write_out(out, buffer, headlen);
+        trace_begin("body");
         if (strcmp(method, "HEAD") != 0) {
-            if (is_chunked(buffer))
-                write_chunks(sock, buffer, out);
+            if (range && status_code == 206)
+                write_ranges(sock, buffer, out, flush);
+            else if (is_chunked(buffer))
+                write_chunks(sock, buffer, out, flush);
             else
-                write_body(sock, buffer, out, bar);
+                write_body(sock, buffer, out, bar, zerocopy);
         }
         if (fclose(out) != 0)
             sfail("close failed");
-    } else if (status_code >= 400)
-        print_status_line(buffer);
+        trace_end("body");
+        if (store && !range)
+            commit_store();
+    } else if (status_code >= 400 && !(expect && status_code == 417))
+        print_status_line(buffer);  // 417 is retried without the expectation
     return status_code;
 }
 
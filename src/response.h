@@ -1,4 +1,6 @@
 char* get_header(char* response, char* name);
 int handle_response(char* buffer, FILE* sock, URL url, char* dest, int resume,
-        char* method, int entire, int direct, int lax, int zip, FILE* bar);
+        char* etag, char* range, char* method, int expect, int waiting,
+        int entire, int direct, int lax, int zip, int flush, int zerocopy,
+        char* store, FILE* bar, FILE* report);
 void check_proxy_connect(char* buffer, FILE* sock);
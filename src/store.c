@@ -0,0 +1,122 @@
+#define _POSIX_C_SOURCE 200112L
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <unistd.h>
+#include <errno.h>
+#include <fcntl.h>
+#include <limits.h>   // PATH_MAX
+#include <sys/stat.h>
+#ifdef __linux__
+#include <sys/ioctl.h>
+#include <linux/fs.h> // FICLONE
+#endif
+#include "util.h"
+#include "response.h"
+#include "digest.h"
+#include "store.h"
+
+// only one body is written per process, so the pending entry can be global
+static char stored[PATH_MAX], temp[PATH_MAX], target[PATH_MAX];
+
+static void discard(void) {
+    if (temp[0])
+        unlink(temp);  // the body was not completely written
+}
+
+static int reflink(const char* path, const char* dest) {
+#ifdef FICLONE
+    int in = open(path, O_RDONLY);
+    int out = in < 0 ? -1 : open(dest, O_WRONLY | O_CREAT | O_EXCL, 0666);
+    int result = out < 0 ? -1 : ioctl(out, FICLONE, in);
+    if (in >= 0)
+        close(in);
+    if (out >= 0)
+        close(out);
+    if (out >= 0 && result != 0)
+        unlink(dest);
+    return result == 0;
+#else
+    (void)path, (void)dest;
+    return 0;
+#endif
+}
+
+static void copy(const char* path, const char* dest) {
+    char buf[BUFSIZE];
+    FILE* in = fopen(path, "r");
+    FILE* out = in ? fopen(dest, "w") : NULL;
+    if (out == NULL)
+        sfail("open failed");
+    for (size_t n = 0; (n = fread(buf, 1, sizeof(buf), in)) > 0;)
+        if (fwrite(buf, 1, n, out) != n)
+            sfail("write failed");
+    if (ferror(in) || fclose(out) != 0)
+        sfail("copy failed");
+    fclose(in);
+}
+
+static void materialize(const char* path, const char* dest) {
+    // a reflink is a private copy-on-write copy, but a hard link shares the
+    // (read only) store file, and a copy is needed across file systems
+    if (!reflink(path, dest) && link(path, dest) != 0)
+        copy(path, dest);
+}
+
+static void add_field(Sha1* sha, const char* field, size_t len) {
+    // the terminating 0 keeps the fields apart
+    sha1_update(sha, (const unsigned char*)field, len);
+    sha1_update(sha, (const unsigned char*)"", 1);
+}
+
+static int get_key(char* key, URL url, char* header) {
+    // the key is the sha-1 of the url and entity tag, so that an entry is
+    // only found by the resource whose body it holds
+    char* etag = get_header(header, "ETag:");
+    if (etag == NULL || strncmp(etag, "W/", 2) == 0)
+        return 0;  // weak tags do not identify the bytes of the body
+    char* fields[] = {url.scheme[0] ? url.scheme : "http", url.host,
+                      url.port, url.path, url.query};
+    unsigned char digest[20];
+    Sha1 sha;
+    sha1_init(&sha);
+    for (size_t i = 0; i < sizeof(fields) / sizeof(fields[0]); i++)
+        add_field(&sha, fields[i], strlen(fields[i]));
+    add_field(&sha, etag, strcspn(etag, "\r\n"));
+    sha1_final(&sha, digest);
+    for (int i = 0; i < 20; i++)
+        sprintf(key + 2 * i, "%02x", digest[i]);
+    return 1;
+}
+
+FILE* open_store(char* store, URL url, char* header, char* dest, int* hit) {
+    char key[41];
+    if (!get_key(key, url, header))
+        return NULL;
+    if (mkdir(store, 0777) != 0 && errno != EEXIST)
+        sfail("failed to create store directory");
+    size_t N = sizeof(stored);
+    if ((size_t)snprintf(stored, N, "%s/%s", store, key) >= N ||
+            (size_t)snprintf(temp, N, "%s.%ld", stored, (long)getpid()) >= N ||
+            (size_t)snprintf(target, N, "%s", dest) >= N)
+        fail("error: store path too long", EUSAGE);
+    if (access(stored, F_OK) == 0) {
+        materialize(stored, dest);
+        *hit = 1;
+        return NULL;
+    }
+    FILE* out = fopen(temp, "w");
+    if (out == NULL || atexit(discard) != 0)
+        sfail("failed to open store file");
+    return out;
+}
+
+void commit_store(void) {
+    // the body only appears in the store after it was completely written
+    if (temp[0] == 0)
+        return;
+    if (chmod(temp, 0444) != 0 || rename(temp, stored) != 0)
+        sfail("failed to commit store file");
+    temp[0] = 0;
+    materialize(stored, target);
+}
@@ -0,0 +1,2 @@
+FILE* open_store(char* store, URL url, char* header, char* dest, int* hit);
+void commit_store(void);
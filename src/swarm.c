@@ -0,0 +1,271 @@
+#define _POSIX_C_SOURCE 200112L
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <unistd.h>
+#include <signal.h>
+#include <time.h>
+#include <limits.h>   // PATH_MAX
+#include <sys/wait.h>
+#include "util.h"
+#include "response.h"
+#include "swarm.h"
+
+#define MINRUN (1 << 20)  // smallest range given to a mirror
+#define TARGET 2          // seconds that each range should take
+
+typedef struct {
+    char* url;
+    char etag[256];
+    pid_t pid;
+    int alive, cancelled, twin;  // twin races for the same range, or -1
+    size_t first, last, size;
+    long long began, latency;    // microseconds
+    double speed;                // bytes per second, 0 until measured
+} Mirror;
+
+// ranges not yet downloaded, which grow only when a mirror fails
+typedef struct {
+    size_t first, last;
+} Span;
+
+static Span* pending;
+static int npending;
+
+static long long now(void) {
+    struct timespec ts;
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    return (long long)ts.tv_sec * 1000000 + ts.tv_nsec / 1000;
+}
+
+static pid_t run_child(int (*head)(char*, char*, char*),
+        int (*download)(char*, char*, char*, char*), char* url, char* path,
+        char* range, char* etag, FILE* out) {
+    // runs head with the output in out, or otherwise download
+    fflush(stdout);
+    pid_t pid = fork();
+    if (pid == -1)
+        sfail("fork failed");
+    if (pid == 0) {
+        setpgid(0, 0);  // so that retries are killed with the child
+        if (out)
+            dup2(fileno(out), STDOUT_FILENO);
+        exit(head ? head(url, "-", range) : download(url, path, range, etag));
+    }
+    setpgid(pid, pid);  // also here, in case the child has not run yet
+    return pid;
+}
+
+static int reap(pid_t* pid) {
+    int status = 0;
+    if ((*pid = wait(&status)) == -1)
+        sfail("wait failed");
+    return WIFEXITED(status) ? WEXITSTATUS(status) : ESYSTEM;
+}
+
+static int by_latency(const void* a, const void* b) {
+    const Mirror *x = a, *y = b;
+    return (x->latency > y->latency) - (x->latency < y->latency);
+}
+
+static int read_probe(Mirror* m, FILE* file) {
+    // the probe is the response header and first byte of the file
+    char header[BUFSIZE];
+    rewind(file);
+    size_t n = fread(header, 1, sizeof(header) - 1, file);
+    header[n] = 0;
+    fclose(file);
+    char* space = strchr(header, ' ');
+    if (strncmp(header, "HTTP/", 5) != 0 || !space || atoi(space) != 206 ||
+            !strstr(header, "\r\n\r\n"))
+        return 0;  // no range support (or no response)
+    char* range = get_header(header, "Content-Range:");
+    char* etag = get_header(header, "ETag:");
+    if (!range || !strchr(range, '/'))
+        return 0;
+    m->size = strtoull(strchr(range, '/') + 1, NULL, 10);
+    snprintf(m->etag, sizeof(m->etag), "%.*s", etag ?
+             (int)strcspn(etag, "\r\n") : 0, etag ? etag : "");
+    return m->size > 0;
+}
+
+// fetches the first byte from every mirror at once, and keeps the mirrors
+// that support ranges in the order that they answered
+static int probe(Mirror* mirrors, int n, int (*head)(char*, char*, char*)) {
+    FILE* files[n];
+    long long began = now();
+    for (int i = 0; i < n; i++) {
+        if ((files[i] = tmpfile()) == NULL)
+            sfail("tmpfile failed");
+        mirrors[i].pid = run_child(head, NULL, mirrors[i].url, NULL, "0-0",
+                                   NULL, files[i]);
+    }
+    for (int done = 0; done < n; done++) {
+        pid_t pid = 0;
+        int status = reap(&pid);
+        for (int i = 0; i < n; i++) {
+            if (mirrors[i].pid != pid)
+                continue;
+            mirrors[i].pid = 0;
+            mirrors[i].latency = now() - began;
+            mirrors[i].alive = read_probe(&mirrors[i], files[i]) &&
+                               status == OK;
+        }
+    }
+    // the first url given is the reference for the size and entity tag
+    Mirror* ref = NULL;
+    for (int i = 0; i < n && ref == NULL; i++)
+        ref = mirrors[i].alive ? &mirrors[i] : NULL;
+    int alive = 0;
+    for (int i = 0; i < n; i++) {
+        Mirror* m = &mirrors[i];
+        if (m->alive && (m->size != ref->size ||
+                (m->etag[0] && ref->etag[0] && strcmp(m->etag, ref->etag))))
+            m->alive = 0;
+        if (!m->alive)
+            fprintf(stderr, "dropped mirror %s\n", m->url);
+        alive += m->alive;
+    }
+    qsort(mirrors, n, sizeof(Mirror), by_latency);
+    return alive;
+}
+
+static void start_run(Mirror* m, size_t first, size_t last, char* path,
+        int (*download)(char*, char*, char*, char*)) {
+    char range[64];
+    snprintf(range, sizeof(range), "%zu-%zu", first, last);
+    m->first = first, m->last = last, m->began = now();
+    // a mirror that changed since the probe sends the whole file instead,
+    // which fails the run, so it is dropped and its range taken by another
+    // (weak tags cannot be used with If-Range)
+    char* etag = m->etag[0] && strncmp(m->etag, "W/", 2) != 0 ? m->etag :
+                 NULL;
+    m->pid = run_child(NULL, download, m->url, path, range, etag, NULL);
+}
+
+static void take_pending(Mirror* m, char* path,
+        int (*download)(char*, char*, char*, char*)) {
+    // faster mirrors take longer ranges, so the ranges take about as long
+    int k = 0;
+    for (int i = 1; i < npending; i++)
+        k = pending[i].first < pending[k].first ? i : k;
+    Span* span = &pending[k];
+    size_t left = span->last - span->first + 1;
+    size_t len = m->speed * TARGET > MINRUN ? m->speed * TARGET : MINRUN;
+    if (len >= left || left - len < MINRUN / 2)
+        len = left;
+    start_run(m, span->first, span->first + len - 1, path, download);
+    span->first += len;
+    if (len == left)
+        *span = pending[--npending];
+}
+
+static double get_remaining(Mirror* m) {
+    // seconds that the range in flight should still take
+    double elapsed = (now() - m->began) / 1e6;
+    return m->speed > 0 ? (m->last - m->first + 1) / m->speed - elapsed :
+           elapsed;
+}
+
+static void take_slowest(Mirror* mirrors, int n, Mirror* m, char* path,
+        int (*download)(char*, char*, char*, char*)) {
+    // when nothing is left, an idle mirror races the mirror that is
+    // expected to finish last if it would finish sooner itself
+    Mirror* slowest = NULL;
+    for (int i = 0; i < n; i++) {
+        Mirror* o = &mirrors[i];
+        if (o->pid && !o->cancelled && o->twin == -1 && (!slowest ||
+                get_remaining(o) > get_remaining(slowest)))
+            slowest = o;
+    }
+    if (!slowest || m->speed == 0 || (slowest->last - slowest->first + 1) /
+            m->speed >= get_remaining(slowest))
+        return;
+    start_run(m, slowest->first, slowest->last, path, download);
+    m->twin = slowest - mirrors;
+    slowest->twin = m - mirrors;
+}
+
+static void finish_run(Mirror* mirrors, Mirror* m, int status) {
+    Mirror* twin = m->twin >= 0 ? &mirrors[m->twin] : NULL;
+    m->pid = 0, m->twin = -1;
+    if (twin)
+        twin->twin = -1;
+    if (m->cancelled) {
+        m->cancelled = 0;
+        return;
+    }
+    if (status == OK) {
+        double speed = (m->last - m->first + 1) /
+                       ((now() - m->began) / 1e6 + 1e-3);
+        m->speed = m->speed > 0 ? (m->speed + speed) / 2 : speed;
+        if (twin && twin->pid) {  // the range is done, so stop the other
+            kill(-twin->pid, SIGTERM);
+            twin->cancelled = 1;
+        }
+        return;
+    }
+    fprintf(stderr, "dropped mirror %s\n", m->url);
+    m->alive = 0;
+    if (!twin || !twin->pid)  // otherwise the twin still has the range
+        pending[npending++] = (Span){m->first, m->last};
+}
+
+int swarm(char** urls, int n, char* dest,
+        int (*head)(char*, char*, char*),
+        int (*download)(char*, char*, char*, char*)) {
+    char part[PATH_MAX];
+    Mirror mirrors[n];
+    memset(mirrors, 0, sizeof(mirrors));
+    for (int i = 0; i < n; i++)
+        mirrors[i].url = urls[i], mirrors[i].twin = -1;
+    if (snprintf(part, sizeof(part), "%s.part", dest) >= (int)sizeof(part))
+        fail("error: output path too long", EUSAGE);
+    if (probe(mirrors, n, head) == 0)
+        fail("error: no mirror supports byte ranges", EPROTOCOL);
+    size_t size = mirrors[0].alive ? mirrors[0].size : 0;
+    for (int i = 1; size == 0; i++)
+        size = mirrors[i].alive ? mirrors[i].size : 0;
+
+    FILE* out = fopen(part, "w");
+    if (out == NULL || ftruncate(fileno(out), size) != 0 || fclose(out) != 0)
+        sfail("failed to create partial file");
+    // each failure adds at most one span, after taking at least one
+    if ((pending = malloc((n + 1) * sizeof(Span))) == NULL)
+        sfail("alloc failed");
+    pending[npending++] = (Span){0, size - 1};
+
+    int status = OK, running = 0;
+    while (1) {
+        for (int i = 0; i < n; i++) {
+            Mirror* m = &mirrors[i];
+            if (!m->alive || m->pid)
+                continue;
+            if (npending > 0)
+                take_pending(m, part, download);
+            else
+                take_slowest(mirrors, n, m, part, download);
+            running += m->pid != 0;
+        }
+        if (running == 0)
+            break;
+        pid_t pid = 0;
+        int result = reap(&pid);
+        for (int i = 0; i < n; i++) {
+            if (mirrors[i].pid == pid) {
+                running--;
+                status = result != OK && !mirrors[i].cancelled ? result :
+                         status;
+                finish_run(mirrors, &mirrors[i], result);
+            }
+        }
+    }
+    free(pending);
+    if (npending > 0) {
+        unlink(part);
+        return status != OK ? status : ESYSTEM;
+    }
+    if (rename(part, dest) != 0)
+        sfail("rename failed");
+    return OK;
+}
@@ -0,0 +1,3 @@
+int swarm(char** urls, int n, char* dest,
+        int (*head)(char*, char*, char*),
+        int (*download)(char*, char*, char*, char*));
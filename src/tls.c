@@ -2,10 +2,33 @@
 #define _GNU_SOURCE   // sometimes needed for fopencookie (e.g. musl)
 #include <stdio.h>
 #include <stdlib.h>
+#include <stdint.h>
+#include <string.h>
+#include <fcntl.h>
+#include <unistd.h>
+#include <time.h>
+#include <poll.h>
 #include <sys/stat.h>
 #include <tls.h>
 #include "shim.h"
 #include "tls.h"
+#include "trace.h"
+#include "trust.h"
+
+// the tls session of each open stream, so that a tunnel through an https
+// proxy can use the outer session directly instead of its stdio buffers;
+// pending holds data that wait_tls read ahead
+typedef struct {
+    FILE* file;
+    struct tls* tls;
+    int fd;
+    char pending[512];
+    size_t pos, len;
+} Stream;
+
+static Stream streams[8];
+static int nonblocking;  // while wait_tls reads ahead
+#define NSTREAMS (sizeof(streams) / sizeof(streams[0]))
 
 static int isdir(const char* path) {
     // "If the named file is a symbolic link, the stat() function shall
@@ -27,9 +50,25 @@ static void fail(const char* message, struct tls* tls) {
     exit(1);
 }
 
+static Stream* find_stream(FILE* file, void* tls) {
+    for (size_t i = 0; i < NSTREAMS; i++)
+        if ((file && streams[i].file == file) || (tls && streams[i].tls == tls))
+            return &streams[i];
+    return NULL;
+}
+
 static ssize_t read_tls(void* tls, char* buf, size_t len) {
+    Stream* s = find_stream(NULL, tls);
+    if (s && s->pos < s->len) {
+        size_t n = s->len - s->pos < len ? s->len - s->pos : len;
+        memcpy(buf, s->pending + s->pos, n);
+        s->pos += n;
+        return n;
+    }
     while (1) {
         ssize_t n = tls_read((struct tls*)tls, buf, len);
+        if ((n == TLS_WANT_POLLIN || n == TLS_WANT_POLLOUT) && nonblocking)
+            return n;  // to the inner session of a tunnel
         if (n == TLS_WANT_POLLIN || n == TLS_WANT_POLLOUT)
             continue;
         if (n < 0)
@@ -47,11 +86,12 @@ static ssize_t write_tls(void* tls, const char* buf, size_t len) {
         else if (n < 0)
             fail("write error", tls);
     }
-    return n;
+    return len;
 }
 
 static struct tls* new_tls_client(const char* cacerts, const char* cert,
-        const char* key, int insecure) {
+        const char* key, int insecure, const char* session,
+        const char* anchors, size_t len) {
     struct tls_config* tls_config = tls_config_new();
     if (!tls_config)
         fail("failed to create tls config", NULL);
@@ -59,6 +99,10 @@ static struct tls* new_tls_client(const char* cacerts, const char* cert,
         tls_config_insecure_noverifycert(tls_config);
         tls_config_insecure_noverifyname(tls_config);
         tls_config_insecure_noverifytime(tls_config);
+    } else if (anchors) {
+        if (tls_config_set_ca_mem(tls_config, (const uint8_t*)anchors,
+                len) != 0)
+            fail("failed to load cached CA certificates", NULL);
     } else if (cacerts) {
         if (isdir(cacerts)) {
             if (tls_config_set_ca_path(tls_config, cacerts) != 0)
@@ -69,6 +113,15 @@ static struct tls* new_tls_client(const char* cacerts, const char* cert,
     if (cert && key)
         if (tls_config_set_keypair_file(tls_config, cert, key) != 0)
             fail("failed to load client certificate and/or private key", NULL);
+#ifdef TLS_SESSION
+    // the session is resumed from the file and then replaced after the
+    // handshake, so the file stays open until the process exits
+    int fd = session ? open(session, O_RDWR | O_CREAT, 0600) : -1;
+    if (fd != -1 && tls_config_set_session_fd(tls_config, fd) != 0)
+        fail("failed to set tls session file", NULL);
+#else
+    (void)session;
+#endif
 
     struct tls* tls = tls_client();
     if (!tls)
@@ -79,7 +132,21 @@ static struct tls* new_tls_client(const char* cacerts, const char* cert,
     return tls;
 }
 
+static int handshake(struct tls* tls) {
+    // libtls would otherwise handshake lazily on the first read or write
+    trace_begin("tls");
+    int result = 0;
+    do {
+        result = tls_handshake(tls);
+    } while (result == TLS_WANT_POLLIN || result == TLS_WANT_POLLOUT);
+    trace_end("tls");
+    return result;
+}
+
 static int end_tls(void* tls) {
+    for (size_t i = 0; i < NSTREAMS; i++)
+        if (streams[i].tls == tls)
+            streams[i].file = NULL, streams[i].tls = NULL;
     if (tls) {
         // ignore errors (not all servers close properly)
         tls_close((struct tls*)tls);
@@ -88,14 +155,71 @@ static int end_tls(void* tls) {
     return 0;
 }
 
-static FILE* fopentls(struct tls* tls) {
-    return fopencookie(tls, "r+",
+static FILE* fopentls(struct tls* tls, int fd) {
+    FILE* file = fopencookie(tls, "r+",
         (cookie_io_functions_t){read_tls, write_tls, NULL, end_tls});
+    for (size_t i = 0; i < NSTREAMS; i++) {
+        if (file && streams[i].file == NULL) {
+            streams[i] = (Stream){.file = file, .tls = tls, .fd = fd};
+            break;
+        }
+    }
+    return file;
+}
+
+static struct tls* find_tls(FILE* file) {
+    Stream* s = find_stream(file, NULL);
+    return s ? s->tls : NULL;
+}
+
+static int get_tls_fd(FILE* file) {
+    // the socket under a tls stream (or under the outer one of a tunnel)
+    Stream* s = find_stream(file, NULL);
+    return s ? s->fd : -1;
+}
+
+static long long now_ms(void) {
+    struct timespec ts;
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    return (long long)ts.tv_sec * 1000 + ts.tv_nsec / 1000000;
+}
+
+int wait_tls(FILE* file, int ms) {
+    // waits up to ms for application data, which is kept for read_tls;
+    // records without any (like tls 1.3 session tickets) do not end the
+    // wait, and data that a tunnel has already buffered is read first
+    Stream* s = find_stream(file, NULL);
+    if (s == NULL)
+        return -1;  // not a tls stream
+    int flags = fcntl(s->fd, F_GETFL);
+    if (flags == -1 || fcntl(s->fd, F_SETFL, flags | O_NONBLOCK) == -1)
+        return 0;
+    ssize_t n = TLS_WANT_POLLIN;
+    nonblocking = 1;
+    for (long long end = now_ms() + ms;;) {
+        n = tls_read(s->tls, s->pending, sizeof(s->pending));
+        struct pollfd pfd = {s->fd, n == TLS_WANT_POLLOUT ? POLLOUT : POLLIN,
+                             0};
+        if ((n != TLS_WANT_POLLIN && n != TLS_WANT_POLLOUT) ||
+                (ms = end - now_ms()) <= 0 || poll(&pfd, 1, ms) <= 0)
+            break;
+    }
+    nonblocking = 0;
+    fcntl(s->fd, F_SETFL, flags);
+    if (n == TLS_WANT_POLLIN || n == TLS_WANT_POLLOUT)
+        return 0;
+    s->pos = 0, s->len = n > 0 ? n : 0;
+    return 1;  // data, or an end or error for read_tls to report
 }
 
 static ssize_t reader(struct tls *tls, void *buf, size_t n, void *sock) {
     (void)tls;
-    return fread(buf, 1, n, sock);
+    size_t m = fread(buf, 1, n, sock);
+    if (nonblocking && ferror(sock)) {  // no more data yet
+        clearerr(sock);
+        return m > 0 ? (ssize_t)m : TLS_WANT_POLLIN;
+    }
+    return m;
 }
 
 static ssize_t writer(struct tls *tls, const void *buf, size_t n, void *sock) {
@@ -103,18 +227,76 @@ static ssize_t writer(struct tls *tls, const void *buf, size_t n, void *sock) {
     return fwrite(buf, 1, n, sock);
 }
 
+// records of the inner session go straight to and from the outer session
+static ssize_t tunnel_reader(struct tls *tls, void *buf, size_t n,
+        void *outer) {
+    (void)tls;
+    return read_tls(outer, buf, n);
+}
+
+static ssize_t tunnel_writer(struct tls *tls, const void *buf, size_t n,
+        void *outer) {
+    (void)tls;
+    return write_tls(outer, buf, n);
+}
+
 FILE* wrap_tls(FILE* sock, const char* host, const char* cacerts,
-        const char* cert, const char* key, int insecure) {
-    struct tls* tls = new_tls_client(cacerts, cert, key, insecure);
-    if (tls_connect_cbs(tls, reader, writer, sock, host) != 0)
+        const char* cert, const char* key, int insecure, const char* session) {
+    struct tls* tls = new_tls_client(cacerts, cert, key, insecure, session,
+                                     NULL, 0);
+    // nothing is left in the read buffer of the outer stream after the
+    // CONNECT response, because a tls server waits for the client hello
+    struct tls* outer = find_tls(sock);
+    if (outer && fflush(sock) != 0)
+        fail("write error", outer);
+    if (tls_connect_cbs(tls, outer ? tunnel_reader : reader,
+            outer ? tunnel_writer : writer, outer ? (void*)outer : sock,
+            host) != 0)
         fail("tls_connect_cbs", tls);
-    return fopentls(tls);
+    if (handshake(tls) != 0)
+        fail("tls_handshake", tls);
+    return fopentls(tls, outer ? get_tls_fd(sock) : fileno(sock));
 }
 
+#ifdef TLS_TRUST
+static const char* get_bundle(const char* cacerts, int insecure) {
+    // only bundles are cached, not CA directories
+    if (insecure || isdir(cacerts))
+        return NULL;
+    return cacerts ? cacerts : tls_default_ca_cert_file();
+}
+#else
+#define get_bundle(cacerts, insecure) NULL
+#define load_anchors(...) NULL
+#define keep_anchors(...) (void)0
+#define drop_anchors(host) (void)0
+#define tls_peer_cert_chain_pem(tls, len) NULL
+#endif
+
+// returns NULL if the cached CA certificates of the host fail, so that the
+// caller can connect again and verify with the whole bundle
 FILE* start_tls(int sock, const char* host, const char* cacerts,
-        const char* cert, const char* key, int insecure) {
-    struct tls* tls = new_tls_client(cacerts, cert, key, insecure);
+        const char* cert, const char* key, int insecure, const char* session) {
+    const char* bundle = get_bundle(cacerts, insecure);
+    size_t len = 0;
+    char* anchors = bundle ? load_anchors(bundle, host, &len) : NULL;
+    struct tls* tls = new_tls_client(cacerts, cert, key, insecure, session,
+                                     anchors, len);
     if (tls_connect_socket(tls, sock, host) != 0)
         fail("tls_connect_socket", tls);
-    return fopentls(tls);
+    int result = handshake(tls), cached = anchors != NULL;
+    free(anchors);
+    if (result != 0 && cached) {
+        drop_anchors(host);
+        end_tls(tls);
+        close(sock);
+        return NULL;
+    }
+    if (result != 0)
+        fail("tls_handshake", tls);
+    const char* chain = bundle && !cached ?
+        (const char*)tls_peer_cert_chain_pem(tls, &len) : NULL;
+    if (chain)
+        keep_anchors(bundle, host, chain, len);
+    return fopentls(tls, sock);
 }
@@ -1,9 +1,13 @@
 #ifdef TLS
 FILE* start_tls(int sock, const char* host, const char* cacerts,
-                const char* cert, const char* key, int insecure);
+                const char* cert, const char* key, int insecure,
+                const char* session);
 FILE* wrap_tls(FILE* sock, const char* host, const char* cacerts,
-                const char* cert, const char* key, int insecure);
+                const char* cert, const char* key, int insecure,
+                const char* session);
+int wait_tls(FILE* file, int ms);
 #else
 #define start_tls(...) fail("https not supported", EUSAGE)
 #define wrap_tls(...) fail("https not supported", EUSAGE)
+#define wait_tls(file, ms) (-1)
 #endif
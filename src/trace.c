@@ -0,0 +1,158 @@
+#define _POSIX_C_SOURCE 200112L
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <time.h>
+#include <unistd.h>
+#include <fcntl.h>
+#include "util.h"
+#include "trace.h"
+
+typedef struct {
+    const char* name;
+    long long start, duration;  // microseconds, duration -1 while open
+} Span;
+
+int tracing;
+static const char* path;
+static Span spans[256];
+static int nspans;
+
+static long long now(void) {
+    struct timespec ts;
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    return (long long)ts.tv_sec * 1000000 + ts.tv_nsec / 1000;
+}
+
+// chrome trace event format with one complete ("X") event per phase, where
+// the closing bracket of the array is optional so that files can be appended
+static void write_events(FILE* file, long long end) {
+    fseek(file, 0, SEEK_END);
+    if (ftell(file) == 0)
+        fputs("[\n", file);
+    for (int i = 0; i < nspans; i++)
+        fprintf(file, "{\"name\":\"%s\",\"ph\":\"X\",\"pid\":%ld,\"tid\":%ld,"
+                "\"ts\":%lld,\"dur\":%lld%s},\n", spans[i].name,
+                (long)getpid(), (long)getpid(), spans[i].start,
+                spans[i].duration < 0 ? end - spans[i].start :
+                spans[i].duration, spans[i].duration < 0 ?
+                ",\"args\":{\"error\":true}" : "");
+}
+
+// log-linear buckets that keep the top 5 bits of the value, like an
+// hdr histogram with about 3% precision
+static long long get_bucket(long long value) {
+    int shift = 0;
+    while ((value >> shift) >= 32)
+        shift++;
+    return (value >> shift) << shift;
+}
+
+typedef struct {
+    char name[16];
+    long long bucket, count;
+} Bin;
+
+static Bin* next_bin(Bin** bins, int nbins, int* capacity) {
+    // returns the slot after the last bin, or NULL if it cannot grow
+    if (nbins == *capacity) {
+        Bin* grown = realloc(*bins, (*capacity * 2 + 64) * sizeof(Bin));
+        if (grown == NULL)
+            return NULL;
+        *bins = grown;
+        *capacity = *capacity * 2 + 64;
+    }
+    return &(*bins)[nbins];
+}
+
+static int read_bins(FILE* file, Bin** bins, int* capacity) {
+    // returns the number of bins in the file, or -1 if they do not fit
+    char line[128];
+    int nbins = 0;
+    rewind(file);
+    while (fgets(line, sizeof(line), file)) {
+        Bin* bin = next_bin(bins, nbins, capacity);
+        if (bin == NULL)
+            return -1;
+        if (sscanf(line, "%15s %lld %lld", bin->name, &bin->bucket,
+                &bin->count) == 3)
+            nbins++;
+    }
+    return nbins;
+}
+
+static int add_spans(Bin** bins, int nbins, int* capacity) {
+    // returns the number of bins with the spans added, or -1
+    for (int i = 0; i < nspans; i++) {
+        if (spans[i].duration < 0)
+            continue;  // phase was interrupted by an error
+        long long bucket = get_bucket(spans[i].duration);
+        int j = 0;
+        while (j < nbins && ((*bins)[j].bucket != bucket ||
+                strcmp((*bins)[j].name, spans[i].name) != 0))
+            j++;
+        if (j == nbins) {
+            Bin* bin = next_bin(bins, nbins++, capacity);
+            if (bin == NULL)
+                return -1;
+            snprintf(bin->name, sizeof(bin->name), "%s", spans[i].name);
+            bin->bucket = bucket;
+            bin->count = 0;
+        }
+        (*bins)[j].count++;
+    }
+    return nbins;
+}
+
+// the histogram file has one "<phase> <bucket> <count>" line per bucket,
+// and it is left as it was if the bins do not fit in memory
+static void write_histogram(FILE* file) {
+    Bin* bins = NULL;
+    int capacity = 0, nbins = read_bins(file, &bins, &capacity);
+    if (nbins >= 0)
+        nbins = add_spans(&bins, nbins, &capacity);
+    // a positioning call is needed between reading and writing the stream
+    if (nbins >= 0 && fseek(file, 0, SEEK_SET) == 0 &&
+            ftruncate(fileno(file), 0) == 0)
+        for (int i = 0; i < nbins; i++)
+            fprintf(file, "%s %lld %lld\n", bins[i].name, bins[i].bucket,
+                    bins[i].count);
+    free(bins);
+}
+
+static void end_tracing(void) {
+    long long end = now();
+    FILE* file = fopen(path, "a+");
+    if (file == NULL)
+        return;
+    // lock so that concurrent invocations can aggregate into the same file
+    struct flock lock = {.l_type = F_WRLCK, .l_whence = SEEK_SET};
+    fcntl(fileno(file), F_SETLKW, &lock);
+    size_t n = strlen(path);
+    if (n >= 5 && strcmp(path + n - 5, ".json") == 0)
+        write_events(file, end);
+    else
+        write_histogram(file);
+    fclose(file);  // also releases the lock
+}
+
+void start_tracing(const char* trace) {
+    path = trace;
+    tracing = 1;
+    if (atexit(end_tracing) != 0)
+        sfail("atexit failed");
+}
+
+void begin_trace(const char* name) {
+    if (nspans < (int)(sizeof(spans) / sizeof(Span)))
+        spans[nspans++] = (Span){name, now(), -1};
+}
+
+void end_trace(const char* name) {
+    for (int i = nspans - 1; i >= 0; i--) {
+        if (spans[i].duration < 0 && strcmp(spans[i].name, name) == 0) {
+            spans[i].duration = now() - spans[i].start;
+            return;
+        }
+    }
+}
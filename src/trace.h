@@ -0,0 +1,8 @@
+// tracing is a global so that a disabled trace point costs a single branch
+extern int tracing;
+#define trace_begin(name) (tracing ? begin_trace(name) : (void)0)
+#define trace_end(name) (tracing ? end_trace(name) : (void)0)
+
+void start_tracing(const char* path);
+void begin_trace(const char* name);
+void end_trace(const char* name);
@@ -0,0 +1,223 @@
+#define _POSIX_C_SOURCE 200112L
+#include <stdio.h>
+#include <stdlib.h>
+#include <stdint.h>
+#include <string.h>
+#include <fcntl.h>
+#include <unistd.h>
+#include <limits.h>   // PATH_MAX
+#include <sys/mman.h>
+#include <sys/stat.h>
+#include "util.h"
+#include "trust.h"
+
+// a cache of the CA certificates that verified each host, so that the next
+// connection parses one or two certificates instead of the whole bundle;
+// each file starts with a stamp of the bundle and is ignored if it changed
+
+#define BEGIN "-----BEGIN CERTIFICATE-----"
+#define END "-----END CERTIFICATE-----"
+
+typedef struct {
+    const unsigned char* p;
+    size_t len;
+} Span;
+
+typedef struct {
+    char* data;
+    size_t size;
+    char stamp[64];
+} Bundle;
+
+static int open_bundle(const char* path, Bundle* bundle) {
+    struct stat sb;
+    int fd = open(path, O_RDONLY);
+    if (fd == -1 || fstat(fd, &sb) != 0 || sb.st_size == 0) {
+        if (fd != -1)
+            close(fd);
+        return 0;
+    }
+    bundle->size = sb.st_size;
+    bundle->data = mmap(NULL, bundle->size, PROT_READ, MAP_PRIVATE, fd, 0);
+    close(fd);
+    if (bundle->data == MAP_FAILED)
+        return 0;
+    uint64_t h = 14695981039346656037u;  // FNV-1a
+    for (size_t i = 0; i < bundle->size; i++)
+        h = (h ^ (unsigned char)bundle->data[i]) * 1099511628211u;
+    snprintf(bundle->stamp, sizeof(bundle->stamp), "%lld %lld %016llx\n",
+             (long long)sb.st_mtime, (long long)sb.st_size,
+             (unsigned long long)h);
+    return 1;
+}
+
+static char* get_path(char* path, const char* host) {
+    char name[320];
+    if (snprintf(name, sizeof(name), "ca-%s", host) >= (int)sizeof(name) ||
+            strchr(host, '/'))
+        return NULL;
+    return get_cache_path(path, PATH_MAX, name);
+}
+
+char* load_anchors(const char* bundle, const char* host, size_t* len) {
+    char path[PATH_MAX], stamp[64];
+    Bundle b;
+    FILE* file = get_path(path, host) ? fopen(path, "r") : NULL;
+    if (file == NULL)
+        return NULL;
+    char* pem = NULL;
+    if (fgets(stamp, sizeof(stamp), file) && open_bundle(bundle, &b)) {
+        if (strcmp(stamp, b.stamp) == 0 && (pem = malloc(BUFSIZE * 4))) {
+            *len = fread(pem, 1, BUFSIZE * 4 - 1, file);
+            pem[*len] = 0;
+        }
+        munmap(b.data, b.size);
+    }
+    fclose(file);
+    if (pem && *len == 0) {
+        free(pem);
+        return NULL;
+    }
+    return pem;
+}
+
+void drop_anchors(const char* host) {
+    char path[PATH_MAX];
+    if (get_path(path, host))
+        unlink(path);
+}
+
+static size_t decode(const char* in, size_t n, unsigned char* out) {
+    // base64, skipping line breaks
+    static const char* E =
+        "ABCDEFGHIJKLMNOPQRSTUVWXYZabcdefghijklmnopqrstuvwxyz0123456789+/";
+    size_t len = 0, bits = 0;
+    uint32_t w = 0;
+    for (size_t i = 0; i < n && in[i] != '='; i++) {
+        const char* c = in[i] ? strchr(E, in[i]) : NULL;
+        if (c == NULL)
+            continue;
+        w = w << 6 | (uint32_t)(c - E);
+        if ((bits += 6) >= 8)
+            out[len++] = (unsigned char)(w >> (bits -= 8));
+    }
+    return len;
+}
+
+static const unsigned char* get_tlv(const unsigned char* p,
+        const unsigned char* end, Span* content) {
+    // returns the end of the der element at p and sets its content
+    if (end - p < 2)
+        return NULL;
+    size_t len = p[1], n = 2;
+    if (len & 0x80) {
+        n += len & 0x7f;
+        if (n > 6 || (size_t)(end - p) < n)
+            return NULL;
+        len = 0;
+        for (size_t i = 2; i < n; i++)
+            len = len << 8 | p[i];
+    }
+    if ((size_t)(end - p) - n < len)
+        return NULL;
+    content->p = p + n, content->len = len;
+    return p + n + len;
+}
+
+// Certificate ::= SEQUENCE { tbsCertificate SEQUENCE { [0] version OPTIONAL,
+// serialNumber, signature, issuer, validity, subject, ... }, ... }
+static int get_names(const unsigned char* der, size_t n, Span* issuer,
+        Span* subject) {
+    Span cert, tbs, skip;
+    const unsigned char *p = NULL, *end = NULL;
+    if (!get_tlv(der, der + n, &cert) ||
+            !get_tlv(cert.p, cert.p + cert.len, &tbs))
+        return 0;
+    p = tbs.p, end = tbs.p + tbs.len;
+    if (p < end && *p == 0xa0)
+        p = get_tlv(p, end, &skip);
+    for (int i = 0; p && i < 2; i++)  // serial number and algorithm
+        p = get_tlv(p, end, &skip);
+    issuer->p = p;
+    p = p ? get_tlv(p, end, &skip) : NULL;
+    issuer->len = p ? (size_t)(p - issuer->p) : 0;
+    p = p ? get_tlv(p, end, &skip) : NULL;  // validity
+    subject->p = p;
+    p = p ? get_tlv(p, end, &skip) : NULL;
+    subject->len = p ? (size_t)(p - subject->p) : 0;
+    return p != NULL;
+}
+
+static int same(Span a, Span b) {
+    return a.len == b.len && memcmp(a.p, b.p, a.len) == 0;
+}
+
+// finds the next certificate in pem and returns the end of its block
+static const char* next_cert(const char* pem, const char* end,
+        unsigned char* der, size_t* n, const char** block) {
+    size_t N = strlen(BEGIN), M = strlen(END);
+    for (const char* p = pem; p + N < end; p++) {
+        if (*p != '-' || memcmp(p, BEGIN, N) != 0)
+            continue;
+        const char* q = p + N;
+        while (q + M <= end && (*q != '-' || memcmp(q, END, M) != 0))
+            q++;
+        if (q + M > end || (size_t)(q - p) > BUFSIZE * 4)
+            return NULL;
+        *n = decode(p + N, q - (p + N), der);
+        *block = p;
+        return q + M;
+    }
+    return NULL;
+}
+
+void keep_anchors(const char* bundle, const char* host, const char* chain,
+        size_t len) {
+    // the anchors are the bundle certificates with the subject of a chain
+    // certificate or of its issuer
+    char path[PATH_MAX], temp[PATH_MAX + 32];
+    unsigned char der[BUFSIZE * 3];
+    Span names[16], issuer, subject;
+    unsigned char* copies[8];
+    const char *block = NULL, *p = chain;
+    size_t count = 0, n = 0;
+    Bundle b;
+    while (count < 16 && (p = next_cert(p, chain + len, der, &n, &block)))
+        if (get_names(der, n, &issuer, &subject)) {
+            // the spans point into der, so keep copies
+            unsigned char* copy = malloc(issuer.len + subject.len);
+            if (copy == NULL)
+                break;
+            copies[count / 2] = copy;
+            memcpy(copy, issuer.p, issuer.len);
+            memcpy(copy + issuer.len, subject.p, subject.len);
+            names[count++] = (Span){copy, issuer.len};
+            names[count++] = (Span){copy + issuer.len, subject.len};
+        }
+    FILE* out = NULL;
+    if (count > 0 && get_path(path, host) && open_bundle(bundle, &b)) {
+        snprintf(temp, sizeof(temp), "%s.%ld", path, (long)getpid());
+        const char* end = b.data + b.size;
+        size_t kept = 0;
+        for (p = b.data; (p = next_cert(p, end, der, &n, &block));) {
+            int found = get_names(der, n, &issuer, &subject);
+            for (size_t i = 0; found && i < count; i++) {
+                if (!same(subject, names[i]))
+                    continue;
+                if (out == NULL && (out = fopen(temp, "w")))
+                    fputs(b.stamp, out);
+                if (out && kept + (p - block) + 1 < BUFSIZE * 4) {
+                    fwrite(block, 1, p - block, out);
+                    fputc('\n', out);
+                    kept += (p - block) + 1;
+                }
+                break;
+            }
+        }
+        munmap(b.data, b.size);
+        if (out && (fclose(out) != 0 || rename(temp, path) != 0))
+            unlink(temp);
+    }
+    for (size_t i = 0; i < count / 2; i++)
+        free(copies[i]);
+}
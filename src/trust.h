@@ -0,0 +1,4 @@
+char* load_anchors(const char* bundle, const char* host, size_t* len);
+void keep_anchors(const char* bundle, const char* host, const char* chain,
+        size_t len);
+void drop_anchors(const char* host);
@@ -0,0 +1,52 @@
+#define _POSIX_C_SOURCE 200112L
+#include <stdio.h>
+#include <stdlib.h>
+#include <inttypes.h> // intmax_t
+#include <fcntl.h>
+#include <unistd.h>
+#include <sys/wait.h>
+#include "util.h"
+#include "upload.h"
+
+#define PARTSIZE (8 << 20)  // bytes per part
+
+static void start_part(int (*send)(char*, char*), char* url, size_t first,
+        size_t size) {
+    char part[64];
+    size_t last = first + PARTSIZE < size ? first + PARTSIZE - 1 : size - 1;
+    snprintf(part, sizeof(part), "%jd-%jd/%jd", (intmax_t)first,
+             (intmax_t)last, (intmax_t)size);
+    fflush(stdout);
+    pid_t pid = fork();
+    if (pid == -1)
+        sfail("fork failed");
+    if (pid == 0) {
+        // the response bodies of the parts would interleave on stdout
+        int null = open("/dev/null", O_WRONLY);
+        if (null == -1 || dup2(null, STDOUT_FILENO) == -1)
+            sfail("failed to open /dev/null");
+        exit(send(url, size ? part : NULL));  // an empty file is sent whole
+    }
+}
+
+// sends each part in a child process (which retries it on its own), with
+// at most jobs parts in flight, and stops starting parts after a failure
+int upload_parts(char* url, char* path, int jobs,
+        int (*send)(char*, char*)) {
+    size_t size = get_file_size(path);
+    size_t parts = size ? (size + PARTSIZE - 1) / PARTSIZE : 1, next = 0;
+    int running = 0, status = OK;
+    while (1) {
+        for (; running < jobs && next < parts && status == OK; running++)
+            start_part(send, url, next++ * PARTSIZE, size);
+        if (running == 0)
+            return status;
+        int result = 0;
+        if (wait(&result) == -1)
+            sfail("wait failed");
+        running--;
+        result = WIFEXITED(result) ? WEXITSTATUS(result) : ESYSTEM;
+        if (status == OK)
+            status = result;
+    }
+}
@@ -0,0 +1,2 @@
+int upload_parts(char* url, char* path, int jobs,
+        int (*send)(char*, char*));
@@ -2,6 +2,7 @@
 #include <stdio.h>
 #include <stdlib.h>
 #include <string.h>
+#include <errno.h>
 #include <sys/stat.h>
 #include "util.h"
 
@@ -26,6 +27,26 @@ size_t get_file_size(char* path) {
     return stat(path, &sb) == 0 ? sb.st_size : 0;
 }
 
+char* get_cache_path(char* path, size_t N, const char* name) {
+    // $XDG_CACHE_HOME/hget/<name>, or ~/.cache/hget/<name> by default
+    char* xdg = getenv("XDG_CACHE_HOME");
+    char* home = getenv("HOME");
+    size_t n = xdg && xdg[0] ? (size_t)snprintf(path, N, "%s/hget", xdg) :
+               home ? (size_t)snprintf(path, N, "%s/.cache/hget", home) : N;
+    if (n >= N)
+        return NULL;
+    if (!(xdg && xdg[0])) {
+        path[n - 5] = 0;  // ~/.cache may not exist yet
+        if (mkdir(path, 0700) != 0 && errno != EEXIST)
+            return NULL;
+        path[n - 5] = '/';
+    }
+    if ((mkdir(path, 0700) != 0 && errno != EEXIST) ||
+            (size_t)snprintf(path + n, N - n, "/%s", name) >= N - n)
+        return NULL;
+    return path;
+}
+
 int is_stdout(char* dest) {
     // "-" is interpreted as stdout for compatibility with wget
     return dest == NULL || strcmp(dest, "-") == 0;
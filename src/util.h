@@ -12,4 +12,5 @@ void swrite(FILE* sock, const char* buf);
 int isdir(const char* path);
 char* get_filename(char* path);
 size_t get_file_size(char* path);
+char* get_cache_path(char* path, size_t N, const char* name);
 URL parse_url(char* str);
@@ -0,0 +1,350 @@
+#define _POSIX_C_SOURCE 200112L
+#include <stdio.h>
+#include <stdlib.h>
+#include <stdint.h>
+#include <string.h>
+#include <strings.h>  // strncasecmp
+#include <unistd.h>
+#include <fcntl.h>
+#include <limits.h>   // PATH_MAX, INT_MAX
+#include <sys/mman.h>
+#include <sys/stat.h>
+#include <sys/wait.h>
+#include "util.h"
+#include "digest.h"
+#include "zsync.h"
+
+#define MAXRANGES 64  // byte ranges per request
+
+// the block map of a .zsync file: a header of "Name: value" lines, a blank
+// line, and then the (truncated) rolling and md4 checksums of each block
+typedef struct {
+    size_t blocksize, length, nblocks;
+    int seq, rbytes, cbytes;   // from "Hash-Lengths: 2,2,5" for example
+    unsigned char sha1[20];
+    unsigned char* sums;       // rbytes + cbytes per block
+} Map;
+
+static Map map;
+static int* chain;         // blocks with the same rolling checksum
+static int heads[65536];   // first block for each rolling checksum key
+static char* have;         // blocks already written to the new file
+
+static int run_child(int (*download)(char*, char*, char*, char*), char* url,
+        char* path, char* range, FILE* out) {
+    // each request runs in a child process because errors exit the process
+    fflush(stdout);
+    pid_t pid = fork();
+    if (pid == -1)
+        sfail("fork failed");
+    if (pid == 0) {
+        if (out)
+            dup2(fileno(out), STDOUT_FILENO);
+        exit(download(url, out ? "-" : path, range, NULL));
+    }
+    int status = 0;
+    if (waitpid(pid, &status, 0) == -1)
+        sfail("waitpid failed");
+    return WIFEXITED(status) ? WEXITSTATUS(status) : ESYSTEM;
+}
+
+static int hexval(char c) {
+    return c >= '0' && c <= '9' ? c - '0' : c >= 'a' && c <= 'f' ? c - 'a' + 10
+        : c >= 'A' && c <= 'F' ? c - 'A' + 10 : -1;
+}
+
+static void parse_map(FILE* file) {
+    char line[BUFSIZE];
+    int sha = 0;
+    map.seq = 1, map.rbytes = 4, map.cbytes = 16;
+    rewind(file);
+    while (fgets(line, sizeof(line), file) && strcmp(line, "\n") != 0) {
+        char* value = strchr(line, ':');
+        value = value ? value + 1 + strspn(value + 1, " ") : line;
+        if (strncasecmp(line, "Blocksize:", 10) == 0)
+            map.blocksize = strtoul(value, NULL, 10);
+        else if (strncasecmp(line, "Length:", 7) == 0)
+            map.length = strtoull(value, NULL, 10);
+        else if (strncasecmp(line, "Hash-Lengths:", 13) == 0)
+            sscanf(value, "%d,%d,%d", &map.seq, &map.rbytes, &map.cbytes);
+        else if (strncasecmp(line, "Z-Map2:", 7) == 0)
+            fail("error: compressed zsync files are not supported", EUSAGE);
+        else if (strncasecmp(line, "SHA-1:", 6) == 0)
+            for (sha = 0; sha < 20 && hexval(value[2*sha]) >= 0 &&
+                    hexval(value[2*sha+1]) >= 0; sha++)
+                map.sha1[sha] = hexval(value[2*sha]) << 4 |
+                                hexval(value[2*sha+1]);
+    }
+    if (map.blocksize == 0 || map.seq < 1 || map.seq > 2 || map.rbytes < 1 ||
+            map.rbytes > 4 || map.cbytes < 1 || map.cbytes > 16 || sha != 20)
+        fail("error: invalid zsync file", EPROTOCOL);
+    map.nblocks = map.length / map.blocksize +
+                  (map.length % map.blocksize != 0);
+    // chain holds block numbers as ints, and the sizes below must not wrap
+    if (map.nblocks >= INT_MAX || map.nblocks >= SIZE_MAX / sizeof(int) ||
+            map.nblocks >= SIZE_MAX / (map.rbytes + map.cbytes))
+        fail("error: invalid zsync file", EPROTOCOL);
+    size_t size = map.nblocks * (map.rbytes + map.cbytes);
+    map.sums = malloc(size + 1);
+    chain = malloc((map.nblocks + 1) * sizeof(int));
+    have = calloc(map.nblocks + 1, 1);
+    if (!map.sums || !chain || !have)
+        sfail("alloc failed");
+    if (fread(map.sums, 1, size, file) != size)
+        fail("error: zsync file is truncated", EPROTOCOL);
+}
+
+// the rolling checksum from rsync: a is the sum of the bytes and b is the
+// sum of the prefix sums, both mod 2^16
+static void get_rsum(const unsigned char* p, size_t n, unsigned* a,
+        unsigned* b) {
+    *a = *b = 0;
+    for (size_t i = 0; i < n; i++) {
+        *a += p[i];
+        *b += (n - i) * p[i];
+    }
+    *a &= 0xffff, *b &= 0xffff;
+}
+
+static unsigned get_key(const unsigned char* rsum) {
+    // the key is the low byte or two of b, which are always in the map
+    int n = map.rbytes;
+    return n == 1 ? rsum[0] : rsum[n - 2] << 8 | rsum[n - 1];
+}
+
+static void index_blocks(void) {
+    memset(heads, -1, sizeof(heads));
+    for (size_t j = map.nblocks; j-- > 0;) {
+        unsigned key = get_key(map.sums + j * (map.rbytes + map.cbytes));
+        chain[j] = heads[key];
+        heads[key] = (int)j;
+    }
+}
+
+// checks block j against a window with the given rolling checksum; md4 is
+// computed at most once per window
+static int is_block(size_t j, const unsigned char* window, unsigned a,
+        unsigned b, unsigned char* md, int* hashed) {
+    unsigned char rsum[4] = {a >> 8, a & 0xff, b >> 8, b & 0xff};
+    unsigned char* sums = map.sums + j * (map.rbytes + map.cbytes);
+    if (memcmp(sums, rsum + 4 - map.rbytes, map.rbytes) != 0)
+        return 0;
+    if (!*hashed)
+        md4(window, map.blocksize, md);
+    *hashed = 1;
+    return memcmp(sums + map.rbytes, md, map.cbytes) == 0;
+}
+
+static int is_next_block(size_t j, const unsigned char* data, size_t size,
+        size_t pos) {
+    // with "seq_matches" 2 a block only matches if the next block does too
+    unsigned char md[16];
+    unsigned a, b;
+    int hashed = 0;
+    if (map.seq < 2 || j + 1 >= map.nblocks - 1 || pos + 2 * map.blocksize >
+            size)
+        return 1;
+    get_rsum(data + pos + map.blocksize, map.blocksize, &a, &b);
+    return is_block(j + 1, data + pos + map.blocksize, a, b, md, &hashed);
+}
+
+static void put_block(FILE* part, size_t j, const unsigned char* window) {
+    size_t offset = j * map.blocksize;
+    size_t len = map.length - offset < map.blocksize ? map.length - offset :
+                 map.blocksize;
+    if (fseeko(part, offset, SEEK_SET) != 0 ||
+            fwrite(window, 1, len, part) != len)
+        sfail("write failed");
+    have[j] = 1;
+}
+
+// writes every block that the window matches, and returns whether any did
+static int match(FILE* part, const unsigned char* data, size_t size,
+        size_t pos, unsigned a, unsigned b) {
+    unsigned char md[16];
+    int hashed = 0, found = 0;
+    unsigned char rsum[4] = {a >> 8, a & 0xff, b >> 8, b & 0xff};
+    int j = heads[get_key(rsum + 4 - map.rbytes)];
+    for (; j != -1; j = chain[j]) {
+        if (!is_block(j, data + pos, a, b, md, &hashed) ||
+                !is_next_block(j, data, size, pos))
+            continue;
+        found = 1;
+        if (!have[j])
+            put_block(part, j, data + pos);
+    }
+    return found;
+}
+
+static void match_tail(FILE* part, const unsigned char* data, size_t size) {
+    // the last block is padded with zeros, and is most likely at the end
+    size_t len = map.length % map.blocksize, j = map.nblocks - 1;
+    size_t offsets[2] = {size - len, j * map.blocksize};
+    unsigned char* window = calloc(map.blocksize, 1);
+    unsigned char md[16];
+    if (window == NULL)
+        sfail("alloc failed");
+    for (int i = 0; i < 2 && len > 0 && size >= len && !have[j]; i++) {
+        unsigned a, b;
+        int hashed = 0;
+        if (offsets[i] + len > size)
+            continue;
+        memcpy(window, data + offsets[i], len);
+        get_rsum(window, map.blocksize, &a, &b);
+        if (is_block(j, window, a, b, md, &hashed))
+            put_block(part, j, window);
+    }
+    free(window);
+}
+
+// slides a window over the old file with the rolling checksum and copies
+// every block that the new file shares with it
+static void scan(FILE* part, char* path) {
+    int fd = open(path, O_RDONLY);
+    struct stat sb;
+    if (fd == -1)
+        return;  // nothing to reuse
+    if (fstat(fd, &sb) != 0 || sb.st_size == 0) {
+        close(fd);
+        return;
+    }
+    size_t size = sb.st_size, bs = map.blocksize;
+    unsigned char* data = mmap(NULL, size, PROT_READ, MAP_PRIVATE, fd, 0);
+    close(fd);
+    if (data == MAP_FAILED)
+        sfail("mmap failed");
+    unsigned a = 0, b = 0;
+    if (size >= bs)
+        get_rsum(data, bs, &a, &b);
+    for (size_t pos = 0; pos + bs <= size;) {
+        if (match(part, data, size, pos, a, b)) {
+            pos += bs;
+            if (pos + bs <= size)
+                get_rsum(data + pos, bs, &a, &b);
+            continue;
+        }
+        if (pos + bs < size) {
+            a = (a + data[pos + bs] - data[pos]) & 0xffff;
+            b = (b + a - bs * data[pos]) & 0xffff;
+        }
+        pos++;
+    }
+    match_tail(part, data, size);
+    munmap(data, size);
+}
+
+static int verify(char* path) {
+    unsigned char buf[BUFSIZE], sha1[20];
+    Sha1 sha;
+    FILE* file = fopen(path, "r");
+    if (file == NULL)
+        sfail("open failed");
+    sha1_init(&sha);
+    for (size_t n = 0; (n = fread(buf, 1, sizeof(buf), file)) > 0;)
+        sha1_update(&sha, buf, n);
+    if (ferror(file))
+        sfail("read failed");
+    fclose(file);
+    sha1_final(&sha, sha1);
+    return memcmp(sha1, map.sha1, sizeof(sha1)) == 0;
+}
+
+// checks whether block j of the partial file is already the new one
+static int is_fetched(char* path, size_t j) {
+    unsigned char* window = calloc(map.blocksize, 1);
+    unsigned char md[16];
+    unsigned a, b;
+    int hashed = 0, found = 0;
+    FILE* file = fopen(path, "r");
+    if (file == NULL)
+        sfail("open failed");
+    if (window == NULL)
+        sfail("alloc failed");
+    if (fseeko(file, j * map.blocksize, SEEK_SET) == 0 &&
+            fread(window, 1, map.blocksize, file) > 0) {
+        get_rsum(window, map.blocksize, &a, &b);
+        found = is_block(j, window, a, b, md, &hashed);
+    }
+    fclose(file);
+    free(window);
+    return found;
+}
+
+// requests the missing blocks, coalesced into ranges, a few ranges at a time
+static int fetch_missing(char* url, char* path,
+        int (*download)(char*, char*, char*, char*)) {
+    char ranges[MAXRANGES * 44];
+    size_t n = 0, count = 0, end = map.nblocks;
+    while (end > 0 && have[end - 1])
+        end--;
+    for (size_t j = 0; j < map.nblocks; j++) {
+        if (have[j])
+            continue;
+        size_t first = j;
+        while (j + 1 < map.nblocks && !have[j + 1])
+            j++;
+        size_t last = j + 1 < map.nblocks ? (j + 1) * map.blocksize - 1 :
+                      map.length - 1;
+        n += snprintf(ranges + n, sizeof(ranges) - n, "%s%zu-%zu",
+                      n ? "," : "", first * map.blocksize, last);
+        if (++count == MAXRANGES) {
+            int status = run_child(download, url, path, ranges, NULL);
+            if (status != OK)
+                return status;
+            n = count = 0;
+            // a server that ignores the ranges sends the whole file with a
+            // 200, which is written in place, so the last missing block is
+            // there too; then there is nothing left to request
+            if (end > j + 1 && is_fetched(path, end - 1)) {
+                if (verify(path))
+                    return OK;
+                end = 0;  // a zero block matched, so do not check again
+            }
+        }
+    }
+    if (n > 0)
+        return run_child(download, url, path, ranges, NULL);
+    return OK;
+}
+
+int zsync(char* url, char* dest, int (*download)(char*, char*, char*, char*)) {
+    char mapurl[BUFSIZE], part[PATH_MAX];
+    if (snprintf(mapurl, sizeof(mapurl), "%.*s.zsync", (int)strcspn(url, "?#"),
+            url) >= (int)sizeof(mapurl) ||
+            snprintf(part, sizeof(part), "%s.part", dest) >= (int)sizeof(part))
+        fail("error: url or output path too long", EUSAGE);
+    FILE* file = tmpfile();
+    if (file == NULL)
+        sfail("tmpfile failed");
+    int status = run_child(download, mapurl, NULL, NULL, file);
+    if (status != OK)
+        return status;
+    parse_map(file);
+    fclose(file);
+    index_blocks();
+
+    FILE* out = fopen(part, "w");
+    if (out == NULL || ftruncate(fileno(out), map.length) != 0)
+        sfail("failed to create partial file");
+    scan(out, dest);
+    if (fclose(out) != 0)
+        sfail("close failed");
+    status = fetch_missing(url, part, download);
+    if (status == OK && !verify(part)) {
+        // a block of the old file matched falsely (the checksums in the map
+        // are truncated), so fetch the blocks that were copied from it too
+        fprintf(stderr, "checksum mismatch, fetching reused blocks\n");
+        for (size_t j = 0; j < map.nblocks; j++)
+            have[j] = !have[j];
+        status = fetch_missing(url, part, download);
+    }
+    if (status == OK && !verify(part)) {
+        unlink(part);
+        fail("error: checksum of updated file does not match", EPROTOCOL);
+    }
+    if (status != OK)
+        unlink(part);
+    else if (rename(part, dest) != 0)
+        sfail("rename failed");
+    return status;
+}
@@ -0,0 +1 @@
+int zsync(char* url, char* dest, int (*download)(char*, char*, char*, char*));